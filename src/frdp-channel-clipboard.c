@@ -30,44 +30,249 @@
 #define COMMON(x) x
 #endif
 
+#define FRDP_CLIPBOARD_FORMAT_HTML         0xD010
 #define FRDP_CLIPBOARD_FORMAT_PNG          0xD011
 #define FRDP_CLIPBOARD_FORMAT_JPEG         0xD012
+#define FRDP_CLIPBOARD_FORMAT_RTF          0xD013
 #define FRDP_CLIPBOARD_FORMAT_TEXT_URILIST 0xD014
 
+/* All offsets have the same width so that the header length is known in advance */
+#define FRDP_CF_HTML_HEADER "Version:0.9\r\n" \
+                            "StartHTML:%010" G_GSIZE_FORMAT "\r\n" \
+                            "EndHTML:%010" G_GSIZE_FORMAT "\r\n" \
+                            "StartFragment:%010" G_GSIZE_FORMAT "\r\n" \
+                            "EndFragment:%010" G_GSIZE_FORMAT "\r\n"
+
+#define FRDP_BI_RGB                        0
+#define FRDP_BI_BITFIELDS                  3
+#define FRDP_LCS_SRGB                      0x73524742
+#define FRDP_LCS_GM_IMAGES                 4
+
+/* Upper limit for remote clipboard data kept for repeated pastes */
+#define FRDP_CLIPBOARD_CACHE_SIZE          (64 * 1024 * 1024)
+
+/* FUSE worker threads kept waiting for requests */
+#define FRDP_FUSE_MAX_IDLE_THREADS         4
+
+/* Upper limit for one read from a remote file */
+#define FRDP_FUSE_MAX_READ                 (8 * 1024 * 1024)
+
+/* Remote files are fetched and cached in blocks of this size */
+#define FRDP_FUSE_BLOCK_SIZE               (1024 * 1024)
+
+/* Blocks requested ahead of a sequential reader */
+#define FRDP_FUSE_READAHEAD_BLOCKS         8
+
+/* Upper limit for blocks of remote files kept for repeated reads */
+#define FRDP_FUSE_BLOCK_CACHE_SIZE         (64 * 1024 * 1024)
+
+/* Consecutive reads after which a reader is considered sequential */
+#define FRDP_FUSE_SEQUENTIAL_READS         2
+
+/* Size requests in flight while sizes of listed files are prefetched */
+#define FRDP_FUSE_SIZE_REQUESTS            16
+
+/*
+ * Seconds for which the kernel caches attributes and names of remote files,
+ * these do not change until the clipboard does and that is notified.
+ */
+#define FRDP_FUSE_CACHE_TIMEOUT            3600.0
+
+/* How often deadlines of requests for remote files are checked, in milliseconds */
+#define FRDP_FUSE_DEADLINE_INTERVAL        1000
+
+/* Applications often replace clipboard content several times in a row */
+#define FRDP_CLIPBOARD_OWNER_CHANGE_DELAY  50
+
+/* Microseconds without data after which a new transfer starts */
+#define FRDP_CLIPBOARD_TRANSFER_IDLE       (G_USEC_PER_SEC)
+/* Minimal interval between progress signals in milliseconds */
+#define FRDP_CLIPBOARD_PROGRESS_INTERVAL   100
+
 typedef struct
 {
   FrdpChannelClipboard *self;
   volatile gint         finalized;
 } FrdpClipboardDuration;
 
+/* BITMAPV5HEADER, its first 40 bytes match BITMAPINFOHEADER */
+typedef struct
+{
+  guint32 bV5Size;
+  gint32  bV5Width;
+  gint32  bV5Height;
+  guint16 bV5Planes;
+  guint16 bV5BitCount;
+  guint32 bV5Compression;
+  guint32 bV5SizeImage;
+  gint32  bV5XPelsPerMeter;
+  gint32  bV5YPelsPerMeter;
+  guint32 bV5ClrUsed;
+  guint32 bV5ClrImportant;
+  guint32 bV5RedMask;
+  guint32 bV5GreenMask;
+  guint32 bV5BlueMask;
+  guint32 bV5AlphaMask;
+  guint32 bV5CSType;
+  guint8  bV5Endpoints[36];
+  guint32 bV5GammaRed;
+  guint32 bV5GammaGreen;
+  guint32 bV5GammaBlue;
+  guint32 bV5Intent;
+  guint32 bV5ProfileData;
+  guint32 bV5ProfileSize;
+  guint32 bV5Reserved;
+} FrdpBitmapV5Header;
+
+G_STATIC_ASSERT (sizeof (FrdpBitmapV5Header) == 124);
+
+/*
+ * State of a conversion between UTF8_STRING and CF_UNICODETEXT, the latter is
+ * UTF-16LE with CR LF line endings. Incomplete sequences and a pending CR at
+ * the end of a chunk are carried over to the next chunk.
+ */
+typedef struct
+{
+  gunichar partial;
+  gunichar minimum;
+  guint    needed;
+  gboolean after_cr;
+  gboolean terminated;
+} FrdpTextConverter;
+
+/* Output buffer lengths needed for a chunk of n input bytes or units */
+#define FRDP_TEXT_UTF16_LENGTH(n) (2 * (gsize) (n) + 2)
+#define FRDP_TEXT_UTF8_LENGTH(n)  (3 * (gsize) (n) + 4)
+
+#define FRDP_TEXT_HAS_ZERO_BYTE(w) (((w) - G_GUINT64_CONSTANT (0x0101010101010101)) & ~(w) & G_GUINT64_CONSTANT (0x8080808080808080))
+#define FRDP_TEXT_HAS_ZERO_UNIT(w) (((w) - G_GUINT64_CONSTANT (0x0001000100010001)) & ~(w) & G_GUINT64_CONSTANT (0x8000800080008000))
+
+typedef struct
+{
+  FrdpClipboardDuration *duration;
+  guint                  serial;
+  gboolean               announced;
+  guint                  format_id;
+  GChecksum             *checksum;              /* Fingerprint of the targets received so far */
+  GdkAtom                fingerprint_targets[2];
+  guint                  n_fingerprint_targets;
+  guint                  fingerprint_index;     /* Target being received */
+} FrdpClipboardLocalRequest;
+
 typedef struct
 {
-  guchar   *data;
-  guint32   length;
+  GBytes   *data;
   gboolean  handled;
 } FrdpClipboardResponseData;
 
 typedef struct
 {
+  guint                      id;
   guint                      count;
   guint                     *requested_ids;
   FrdpClipboardResponseData *responses;
+
+  GMainLoop                 *loop;
+  GCancellable              *cancellable;
+  gulong                     cancelled_id;
+  guint                      timeout_id;
+  gboolean                   timed_out;
 } FrdpClipboardRequest;
 
+typedef struct
+{
+  guint                      generation;
+  guint                      format_id;
+  GBytes                    *data;
+} FrdpClipboardCacheEntry;
+
+/* One Format Data Request PDU which still waits for its response */
+typedef struct
+{
+  guint                      request_id;
+  guint                      index;
+} FrdpClipboardPendingResponse;
+
 typedef enum
 {
   FUSE_GETATTR_OP,
   FUSE_LOOKUP_OP,
-  FUSE_READ_OP
+  FUSE_READ_OP,
+  FUSE_BLOCK_OP,
+  FUSE_SIZE_OP
 } FrdpFuseOp;
 
 typedef struct
 {
   gssize     index;
-  fuse_req_t request;
+  fuse_req_t request;            /* NULL for FUSE_BLOCK_OP and FUSE_SIZE_OP */
   FrdpFuseOp op;
+  guint      clip_data_id;
+  guint64    offset;
+  guint      generation;         /* Of remote sizes, FUSE_SIZE_OP only */
+  gint64     deadline;           /* Monotonic time, 0 means no deadline */
 } FrdpRemoteFileRequest;
 
+/* Size of a file which is queued or being requested */
+typedef struct
+{
+  gboolean   sent;
+  GList     *waiters;            /* (FrdpRemoteFileRequest *) with FUSE_LOOKUP_OP or FUSE_GETATTR_OP */
+} FrdpRemoteFileSize;
+
+/* A read waiting for its blocks */
+typedef struct
+{
+  fuse_req_t request;
+  gsize      offset;             /* Within the first block */
+  gsize      size;
+  guint64    first;              /* Number of the first block */
+  guint      n_blocks;
+  guint      pending;            /* Blocks still being fetched */
+  gint       error;              /* Replied instead of data if a block has failed */
+  GBytes    *blocks[FRDP_FUSE_MAX_READ / FRDP_FUSE_BLOCK_SIZE + 1];
+} FrdpRemoteFileRead;
+
+typedef struct
+{
+  guint      clip_data_id;
+  gsize      index;
+  guint64    number;
+  GBytes    *data;               /* NULL while the block is being fetched */
+  GList     *waiters;            /* (FrdpRemoteFileRead *), a read can wait for more blocks */
+  GList      link;               /* In remote_blocks_lru once data are there */
+} FrdpRemoteFileBlock;
+
+/* State of an opened file, stored in fuse_file_info.fh */
+typedef struct
+{
+  guint64    size;
+  guint64    next_offset;        /* Where the next sequential read starts */
+  guint      sequential_reads;
+} FrdpRemoteFileHandle;
+
+/* FUSE filesystem shared by all channels, each of them has a subdirectory */
+typedef struct
+{
+  gint                 ref_count;
+  struct fuse_session *session;
+  GThread             *thread;
+  gchar               *directory;
+  GRWLock              lock;      /* Guards channels */
+  GHashTable          *channels;  /* id -> (FrdpChannelClipboard *) */
+  guint                next_id;
+  GMutex               workers_mutex;
+  GCond                workers_cond; /* Signalled when a worker is done with a channel */
+} FrdpFuseMount;
+
+/* Entries of the kernel cache which are stale since the clipboard has changed */
+typedef struct
+{
+  FrdpFuseMount *mount;
+  fuse_ino_t     parent;
+  GPtrArray     *names;          /* (gchar *) in the parent directory */
+} FrdpFuseInvalidation;
+
 typedef struct
 {
   gchar           *uri;
@@ -96,7 +301,8 @@ struct _FrdpRemoteFileInfo
 
   fuse_ino_t          inode;
   gssize              parent_index; /* -1 means root directory */
-  GList              *children;
+  GArray             *children;     /* (gsize) indexes of files in this directory */
+  GHashTable         *children_names; /* filename -> index of the file in this directory */
 
   gboolean            has_size;
   uint64_t            size;
@@ -112,12 +318,45 @@ typedef struct
 
   GtkClipboard                *gtk_clipboard;
   guint                        clipboard_owner_changed_id;
-
-  GList                       *requests;
+  guint                        owner_change_timeout_id;
+  guint                        targets_serial;        /* Identifies the newest targets request */
+  GdkAtom                     *local_targets;         /* Targets of local clipboard content */
+  gint                         local_targets_count;
+
+  guint                        local_generation;      /* Incremented with each format list sent to the server */
+  gchar                       *announced_targets_checksum;
+  gchar                       *announced_content_checksum; /* NULL if not known yet */
+  GHashTable                  *local_responses;       /* format id -> (GBytes *) already sent for local_generation */
+
+  GHashTable                  *requests;              /* request id -> (FrdpClipboardRequest *) */
+  GQueue                      *pending_responses;     /* (FrdpClipboardPendingResponse *) in the order of sent requests */
+  guint                        next_request_id;
+  GCancellable                *requests_cancellable; /* Cancelled when the remote clipboard content changes */
+  guint                        request_timeout;       /* In milliseconds, 0 means no timeout */
+  guint                        max_data_size;         /* In bytes, 0 means no limit */
+
+  guint64                      transfer_bytes;        /* Transferred in either direction since transfer_start_time */
+  gint64                       transfer_start_time;
+  gint64                       transfer_last_time;
+  gint64                       progress_time;         /* When the progress has been signalled last time */
+  guint                        progress_timeout_id;
 
   gsize                        remote_files_count;
   FrdpRemoteFileInfo          *remote_files_infos;
-  GHashTable                  *remote_files_requests;
+  guint                        remote_files_clip_data_id; /* clipDataId of remote_files_infos, changed with fuse_lock and requests_mutex locked */
+  GHashTable                  *remote_files_requests; /* stream id -> (FrdpRemoteFileRequest *), guarded by requests_mutex */
+  GMutex                       requests_mutex;
+  guint                        deadline_timeout_id;   /* Guarded by requests_mutex */
+  GHashTable                  *remote_blocks;         /* Set of (FrdpRemoteFileBlock *), guarded by blocks_mutex */
+  GQueue                       remote_blocks_lru;     /* Fetched blocks, most recently used first */
+  gsize                        remote_blocks_size;
+  guint64                      remote_blocks_hits;
+  guint64                      remote_blocks_misses;
+  GMutex                       blocks_mutex;          /* Guards also FrdpRemoteFileHandle */
+  GHashTable                  *remote_sizes;          /* index -> (FrdpRemoteFileSize *), guarded by requests_mutex */
+  GQueue                       remote_sizes_queue;    /* Indexes of sizes not requested yet */
+  guint                        remote_sizes_in_flight;
+  guint                        remote_sizes_generation; /* Incremented when remote files are dropped */
 
   gsize                        local_files_count;
   FrdpLocalFileInfo           *local_files_infos;
@@ -125,12 +364,21 @@ typedef struct
   guint                        next_stream_id;
   guint                        fgdw_id;
 
-  struct fuse_session         *fuse_session;
-  GThread                     *fuse_session_thread;
+  FrdpFuseMount               *fuse_mount;           /* NULL until files are pasted for the first time */
+  gboolean                     detached;              /* The channel must not join the mount again */
+  gint                         fuse_workers;          /* FUSE workers serving the channel */
+  guint                        fuse_mount_id;         /* Name of the subdirectory in the mount */
+  fuse_ino_t                   fuse_root_inode;       /* Inode of the subdirectory */
   gchar                       *fuse_directory;
-  GMutex                       fuse_mutex;
+  GRWLock                      fuse_lock;             /* Guards remote files, FUSE workers only read them */
 
   fuse_ino_t                   current_inode;
+  fuse_ino_t                   remote_files_inode_base; /* Inode of remote_files_infos[0] */
+  GArray                      *remote_files_roots;    /* (gsize) indexes of topmost files */
+  GHashTable                  *remote_files_roots_names; /* filename -> index of a topmost file */
+  GHashTable                  *negative_roots_names;  /* Names missing in the root directory, guarded by requests_mutex */
+  GPtrArray                   *stale_names;           /* (gchar *) root names to be invalidated in the kernel */
+  GList                       *stale_size_waiters;    /* (FrdpRemoteFileRequest *) of dropped files, not replied yet */
 
   GList                       *locked_data;           /* List of locked arrays of files - list of (FrdpLocalLockData *) */
   GMutex                       lock_mutex;
@@ -139,19 +387,40 @@ typedef struct
   gboolean                     awaiting_data_request; /* Format list has been send but data were not requested yet */
 
   guint                        remote_clip_data_id;   /* clipDataId for copying from remote side */
+  guint                        remote_clip_data_generation; /* Format list generation locked by remote_clip_data_id */
+
+  guint                        format_list_generation; /* Incremented with each format list from the server */
+  GQueue                      *remote_cache;          /* (FrdpClipboardCacheEntry *), most recently used first */
+  gsize                        remote_cache_size;
+  guint                        remote_files_generation; /* Format list generation of remote_files_infos */
+  guint                        remote_html_id;        /* Id of "HTML Format" on the server, 0 if not offered */
+  guint                        remote_rtf_id;         /* Id of "Rich Text Format" on the server, 0 if not offered */
 
   FrdpClipboardDuration       *duration;
 } FrdpChannelClipboardPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (FrdpChannelClipboard, frdp_channel_clipboard, FRDP_TYPE_CHANNEL)
 
+static FrdpFuseMount *fuse_mount = NULL;
+G_LOCK_DEFINE_STATIC (fuse_mount);
+
 enum
 {
   PROP_0 = 0,
   PROP_CLIPRDR_CLIENT_CONTEXT,
+  PROP_REQUEST_TIMEOUT,
+  PROP_MAX_DATA_SIZE,
   LAST_PROP
 };
 
+enum
+{
+  TRANSFER_PROGRESS,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL];
+
 static void  frdp_channel_clipboard_set_client_context (FrdpChannelClipboard *self,
                                                         CliprdrClientContext *context);
 static guint send_client_format_list                   (FrdpChannelClipboard *self);
@@ -162,6 +431,18 @@ static void  clipboard_owner_change_cb                 (GtkClipboard         *cl
                                                         GdkEventOwnerChange  *event,
                                                         gpointer              user_data);
 
+static void  frdp_clipboard_request_free               (FrdpClipboardRequest *request);
+static void  remote_cache_clear                        (FrdpChannelClipboard *self);
+
+static void  fail_file_request                         (FrdpChannelClipboard  *self,
+                                                        FrdpRemoteFileRequest *request,
+                                                        gint                   error);
+static void  fail_file_requests                        (FrdpChannelClipboard *self,
+                                                        gint64                now,
+                                                        gint                  error);
+static void  fail_stale_size_waiters                   (FrdpChannelClipboard *self);
+static void  frdp_channel_clipboard_unmount            (FrdpChannelClipboard *self);
+
 static void  frdp_local_lock_data_free                 (FrdpLocalLockData    *lock_data);
 static void  lock_current_local_files                  (FrdpChannelClipboard *self,
                                                         guint                 clip_data_id);
@@ -180,6 +461,12 @@ frdp_channel_clipboard_get_property (GObject    *object,
       case PROP_CLIPRDR_CLIENT_CONTEXT:
         g_value_set_pointer (value, priv->cliprdr_client_context);
         break;
+      case PROP_REQUEST_TIMEOUT:
+        g_value_set_uint (value, priv->request_timeout);
+        break;
+      case PROP_MAX_DATA_SIZE:
+        g_value_set_uint (value, priv->max_data_size);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -192,19 +479,34 @@ frdp_channel_clipboard_set_property (GObject      *object,
                                      const GValue *value,
                                      GParamSpec   *pspec)
 {
-  FrdpChannelClipboard *self = FRDP_CHANNEL_CLIPBOARD (object);
+  FrdpChannelClipboard        *self = FRDP_CHANNEL_CLIPBOARD (object);
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
 
   switch (property_id)
     {
       case PROP_CLIPRDR_CLIENT_CONTEXT:
         frdp_channel_clipboard_set_client_context (self, g_value_get_pointer (value));
         break;
+      case PROP_REQUEST_TIMEOUT:
+        priv->request_timeout = g_value_get_uint (value);
+        break;
+      case PROP_MAX_DATA_SIZE:
+        priv->max_data_size = g_value_get_uint (value);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
     }
 }
 
+static void
+frdp_channel_clipboard_dispose (GObject *object)
+{
+  frdp_channel_clipboard_detach (FRDP_CHANNEL_CLIPBOARD (object));
+
+  G_OBJECT_CLASS (frdp_channel_clipboard_parent_class)->dispose (object);
+}
+
 static void
 frdp_channel_clipboard_finalize (GObject *object)
 {
@@ -215,10 +517,17 @@ frdp_channel_clipboard_finalize (GObject *object)
 
   g_signal_handler_disconnect (priv->gtk_clipboard,
                                priv->clipboard_owner_changed_id);
-
-  g_hash_table_unref (priv->remote_files_requests);
-  fuse_session_unmount (priv->fuse_session);
-  fuse_session_exit (priv->fuse_session);
+  if (priv->owner_change_timeout_id != 0)
+    g_source_remove (priv->owner_change_timeout_id);
+  if (priv->progress_timeout_id != 0)
+    g_source_remove (priv->progress_timeout_id);
+  g_clear_pointer (&priv->local_targets, g_free);
+  g_clear_pointer (&priv->announced_targets_checksum, g_free);
+  g_clear_pointer (&priv->announced_content_checksum, g_free);
+  g_hash_table_unref (priv->local_responses);
+
+  g_cancellable_cancel (priv->requests_cancellable);
+  g_hash_table_remove_all (priv->requests);
 
   if (priv->remote_data_in_clipboard)
     gtk_clipboard_clear (priv->gtk_clipboard);
@@ -232,8 +541,25 @@ frdp_channel_clipboard_finalize (GObject *object)
 
   g_mutex_unlock (&priv->lock_mutex);
 
-  g_thread_join (priv->fuse_session_thread);
-  g_mutex_clear (&priv->fuse_mutex);
+  g_clear_object (&priv->requests_cancellable);
+  remote_cache_clear (self);
+  g_queue_free (priv->remote_cache);
+  g_hash_table_unref (priv->requests);
+  g_queue_free_full (priv->pending_responses, g_free);
+
+  /* FUSE requests have been failed when leaving the mount */
+  if (priv->deadline_timeout_id != 0)
+    g_source_remove (priv->deadline_timeout_id);
+  g_hash_table_unref (priv->remote_files_requests);
+  g_hash_table_unref (priv->remote_blocks);
+  g_hash_table_unref (priv->remote_sizes);
+  g_queue_clear (&priv->remote_sizes_queue);
+  g_hash_table_unref (priv->negative_roots_names);
+  if (priv->stale_names != NULL)
+    g_ptr_array_unref (priv->stale_names);
+  g_rw_lock_clear (&priv->fuse_lock);
+  g_mutex_clear (&priv->requests_mutex);
+  g_mutex_clear (&priv->blocks_mutex);
   g_mutex_clear (&priv->lock_mutex);
 
   G_OBJECT_CLASS (frdp_channel_clipboard_parent_class)->finalize (object);
@@ -246,6 +572,7 @@ frdp_channel_clipboard_class_init (FrdpChannelClipboardClass *klass)
 
   gobject_class->get_property = frdp_channel_clipboard_get_property;
   gobject_class->set_property = frdp_channel_clipboard_set_property;
+  gobject_class->dispose = frdp_channel_clipboard_dispose;
   gobject_class->finalize = frdp_channel_clipboard_finalize;
 
   g_object_class_install_property (gobject_class,
@@ -254,31 +581,56 @@ frdp_channel_clipboard_class_init (FrdpChannelClipboardClass *klass)
                                                          "cliprdr-client-context",
                                                          "Context for clipboard client",
                                                          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_REQUEST_TIMEOUT,
+                                   g_param_spec_uint ("request-timeout",
+                                                      "request-timeout",
+                                                      "Time in milliseconds to wait for remote clipboard data, 0 waits forever",
+                                                      0, G_MAXUINT,
+                                                      FRDP_CLIPBOARD_DEFAULT_TIMEOUT,
+                                                      G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_MAX_DATA_SIZE,
+                                   g_param_spec_uint ("max-data-size",
+                                                      "max-data-size",
+                                                      "Maximum size of clipboard data in bytes, 0 means no limit",
+                                                      0, G_MAXUINT,
+                                                      FRDP_CLIPBOARD_DEFAULT_MAX_SIZE,
+                                                      G_PARAM_READWRITE));
+
+  /* Bytes transferred in either direction since the transfer started and its average rate in bytes per second */
+  signals[TRANSFER_PROGRESS] = g_signal_new ("transfer-progress",
+                                             G_TYPE_FROM_CLASS (klass),
+                                             G_SIGNAL_RUN_LAST,
+                                             0, NULL, NULL, NULL,
+                                             G_TYPE_NONE, 2,
+                                             G_TYPE_UINT64,
+                                             G_TYPE_DOUBLE);
 }
 
+/* Inodes of remote files are consecutive, so the index is just their offset from the first one */
 static gssize
 get_remote_file_info_index (FrdpChannelClipboard *self,
                             fuse_ino_t            inode)
 {
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  gssize                       result = -1, i;
 
-  for (i = 0; i < priv->remote_files_count; i++) {
-    if (priv->remote_files_infos[i].inode == inode) {
-      result = i;
-      break;
-    }
-  }
+  if (inode < priv->remote_files_inode_base ||
+      inode - priv->remote_files_inode_base >= priv->remote_files_count)
+    return -1;
 
-  return result;
+  return inode - priv->remote_files_inode_base;
 }
 
 static void
-get_root_attributes (struct stat *attr)
+get_root_attributes (fuse_ino_t   inode,
+                     struct stat *attr)
 {
   memset (attr, 0, sizeof (struct stat));
 
-  attr->st_ino = FUSE_ROOT_ID;
+  attr->st_ino = inode;
   attr->st_mode = S_IFDIR | 0755;
   attr->st_nlink = 2;
   attr->st_uid = getuid ();
@@ -306,834 +658,3121 @@ get_file_attributes (FrdpRemoteFileInfo  info,
   attr->st_atime = attr->st_mtime = attr->st_ctime = time (NULL);
 }
 
+/* Fails requests whose deadline has passed, or all of them if now is 0 */
 static void
-request_size (FrdpChannelClipboard *self,
-              fuse_req_t            request,
-              gsize                 index,
-              FrdpFuseOp            op)
+fail_file_requests (FrdpChannelClipboard *self,
+                    gint64                now,
+                    gint                  error)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpRemoteFileRequest       *request;
+  GHashTableIter               iter;
+  GList                       *failed = NULL, *item;
+
+  g_mutex_lock (&priv->requests_mutex);
+  g_hash_table_iter_init (&iter, priv->remote_files_requests);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &request)) {
+    if (now == 0 || (request->deadline != 0 && request->deadline <= now)) {
+      failed = g_list_prepend (failed, request);
+      g_hash_table_iter_steal (&iter);
+    }
+  }
+  g_mutex_unlock (&priv->requests_mutex);
+
+  for (item = failed; item != NULL; item = item->next)
+    fail_file_request (self, item->data, error);
+
+  g_list_free (failed);
+}
+
+static gboolean
+check_file_requests_deadlines (gpointer user_data)
+{
+  FrdpChannelClipboard        *self = user_data;
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  gboolean                     pending;
+
+  fail_file_requests (self, g_get_monotonic_time (), ETIMEDOUT);
+
+  g_mutex_lock (&priv->requests_mutex);
+  pending = g_hash_table_size (priv->remote_files_requests) > 0;
+  if (!pending)
+    priv->deadline_timeout_id = 0;
+  g_mutex_unlock (&priv->requests_mutex);
+
+  return pending ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+/*
+ * Asks the server for size or a range of a file, the FUSE request is replied
+ * from server_file_contents_response(). Sending can block, so fuse_lock must
+ * not be held.
+ */
+static void
+request_file_contents (FrdpChannelClipboard *self,
+                       fuse_req_t            request,
+                       gsize                 index,
+                       FrdpFuseOp            op,
+                       guint                 clip_data_id,
+                       guint64               offset,
+                       guint32               size)
 {
   CLIPRDR_FILE_CONTENTS_REQUEST  file_contents_request = { 0 };
   FrdpChannelClipboardPrivate   *priv = frdp_channel_clipboard_get_instance_private (self);
-  FrdpRemoteFileRequest         *size_request;
+  FrdpRemoteFileRequest         *file_request;
+  gboolean                       range = op != FUSE_SIZE_OP;
+
+  file_request = g_new0 (FrdpRemoteFileRequest, 1);
+  file_request->index = index;
+  file_request->request = request;
+  file_request->op = op;
+  file_request->clip_data_id = clip_data_id;
+  file_request->offset = offset;
 
-  file_contents_request.streamId = priv->next_stream_id++;
   file_contents_request.listIndex = index;
-  file_contents_request.dwFlags = FILECONTENTS_SIZE;
-  file_contents_request.cbRequested = 8;
-  file_contents_request.nPositionHigh = 0;
-  file_contents_request.nPositionLow = 0;
+  file_contents_request.dwFlags = range ? FILECONTENTS_RANGE : FILECONTENTS_SIZE;
+  file_contents_request.cbRequested = range ? size : 8;
+  file_contents_request.nPositionHigh = offset >> 32;
+  file_contents_request.nPositionLow = offset & 0xffffffff;
   file_contents_request.haveClipDataId = TRUE;
-  file_contents_request.clipDataId = priv->remote_clip_data_id;
+  file_contents_request.clipDataId = clip_data_id;
 
-  size_request = g_new0 (FrdpRemoteFileRequest, 1);
-  size_request->index = index;
-  size_request->request = request;
-  size_request->op = op;
+  if (priv->request_timeout > 0)
+    file_request->deadline = g_get_monotonic_time () + priv->request_timeout * G_TIME_SPAN_MILLISECOND;
 
-  g_hash_table_insert (priv->remote_files_requests, GUINT_TO_POINTER (file_contents_request.streamId), size_request);
-
-  priv->cliprdr_client_context->ClientFileContentsRequest (priv->cliprdr_client_context, &file_contents_request);
+  g_mutex_lock (&priv->requests_mutex);
+  file_contents_request.streamId = priv->next_stream_id++;
+  file_request->generation = priv->remote_sizes_generation;
+  g_hash_table_insert (priv->remote_files_requests, GUINT_TO_POINTER (file_contents_request.streamId), file_request);
+  if (file_request->deadline != 0 && priv->deadline_timeout_id == 0)
+    priv->deadline_timeout_id = g_timeout_add (FRDP_FUSE_DEADLINE_INTERVAL,
+                                               check_file_requests_deadlines,
+                                               self);
+  g_mutex_unlock (&priv->requests_mutex);
+
+  if (priv->cliprdr_client_context->ClientFileContentsRequest (priv->cliprdr_client_context, &file_contents_request) != CHANNEL_RC_OK) {
+    /* Unless the deadline check has taken it meanwhile */
+    g_mutex_lock (&priv->requests_mutex);
+    if (!g_hash_table_steal (priv->remote_files_requests, GUINT_TO_POINTER (file_contents_request.streamId)))
+      file_request = NULL;
+    g_mutex_unlock (&priv->requests_mutex);
+
+    if (file_request != NULL)
+      fail_file_request (self, file_request, EIO);
+  }
 }
 
-static void
-fuse_lookup (fuse_req_t  request,
-             fuse_ino_t  parent_inode,
-             const char *name)
+static guint
+remote_block_hash (gconstpointer key)
 {
-  FrdpChannelClipboard        *self = fuse_req_userdata (request);
-  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  struct fuse_entry_param      entry = {0};
-  gboolean                     found = FALSE;
-  gssize                       parent_index;
-  gsize                        i, child_index;
-  GList                       *iter;
+  const FrdpRemoteFileBlock *block = key;
 
-  g_mutex_lock (&priv->fuse_mutex);
+  return (guint) block->number ^ ((guint) block->index << 12) ^ (block->clip_data_id << 24);
+}
 
-  if (parent_inode == FUSE_ROOT_ID) {
-    for (i = 0; i < priv->remote_files_count && !found; i++) {
-      if (priv->remote_files_infos[i].parent_index == -1 &&
-          g_str_equal (name, priv->remote_files_infos[i].filename)) {
-        found = TRUE;
-        if (priv->remote_files_infos[i].has_size ||
-            priv->remote_files_infos[i].is_directory) {
-          entry.ino = priv->remote_files_infos[i].inode;
-          get_file_attributes (priv->remote_files_infos[i], &entry.attr);
-          entry.attr_timeout = 1.0;
-          entry.entry_timeout = 1.0;
-
-          fuse_reply_entry (request, &entry);
-        } else {
-          request_size (self, request, i, FUSE_LOOKUP_OP);
-        }
-      }
-    }
-  } else {
-    parent_index = get_remote_file_info_index (self, parent_inode);
-    if (parent_index >= 0 && priv->remote_files_infos[parent_index].is_directory) {
-      for (iter = priv->remote_files_infos[parent_index].children; iter != NULL && !found; iter = iter->next) {
-        child_index = *((gsize *) iter->data);
-        if (g_str_equal (name, priv->remote_files_infos[child_index].filename)) {
-          found = TRUE;
-          if (priv->remote_files_infos[child_index].has_size ||
-              priv->remote_files_infos[child_index].is_directory) {
-            entry.ino = priv->remote_files_infos[child_index].inode;
-            get_file_attributes (priv->remote_files_infos[child_index], &entry.attr);
-            entry.attr_timeout = 1.0;
-            entry.entry_timeout = 1.0;
-
-            fuse_reply_entry (request, &entry);
-          } else {
-            request_size (self, request, child_index, FUSE_LOOKUP_OP);
-          }
-        }
-      }
-    }
-  }
+static gboolean
+remote_block_equal (gconstpointer a,
+                    gconstpointer b)
+{
+  const FrdpRemoteFileBlock *block_a = a;
+  const FrdpRemoteFileBlock *block_b = b;
 
-  if (!found)
-    fuse_reply_err (request, ENOENT);
+  return block_a->clip_data_id == block_b->clip_data_id &&
+         block_a->index == block_b->index &&
+         block_a->number == block_b->number;
+}
 
-  g_mutex_unlock (&priv->fuse_mutex);
+static void
+remote_block_free (FrdpRemoteFileBlock *block)
+{
+  g_clear_pointer (&block->data, g_bytes_unref);
+  g_list_free (block->waiters);
+  g_free (block);
 }
 
+/*
+ * Replies directly from the blocks, libfuse splices them to the kernel if it
+ * can, so data are not merged into another buffer first.
+ */
 static void
-fuse_getattr (fuse_req_t             request,
-              fuse_ino_t             inode,
-              struct fuse_file_info *file_info)
+reply_read (FrdpRemoteFileRead *read)
 {
-  FrdpChannelClipboard        *self = fuse_req_userdata (request);
-  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  struct stat                  attr = {0};
-  gssize                       index;
+  struct fuse_bufvec *bufvec;
+  const guchar       *bytes;
+  gsize               length, offset = read->offset, size = read->size, buffer_size;
+  guint               i;
+
+  bufvec = g_malloc0 (sizeof (struct fuse_bufvec) + read->n_blocks * sizeof (struct fuse_buf));
+  for (i = 0; i < read->n_blocks && size > 0 && read->error == 0; i++) {
+    bytes = g_bytes_get_data (read->blocks[i], &length);
+    if (offset >= length)
+      break;
 
-  g_mutex_lock (&priv->fuse_mutex);
+    buffer_size = MIN (size, length - offset);
+    bufvec->buf[bufvec->count].mem = (guchar *) bytes + offset;
+    bufvec->buf[bufvec->count].size = buffer_size;
+    bufvec->count++;
+    size -= buffer_size;
+    offset = 0;
 
-  if (inode == FUSE_ROOT_ID) {
-    get_root_attributes (&attr);
-    fuse_reply_attr (request, &attr, 1);
-  } else {
-    index = get_remote_file_info_index (self, inode);
-    if (index >= 0) {
-      if (priv->remote_files_infos[index].has_size ||
-          priv->remote_files_infos[index].is_directory) {
-        get_file_attributes (priv->remote_files_infos[index], &attr);
-        fuse_reply_attr (request, &attr, 1);
-      } else {
-        request_size (self, request, index, FUSE_GETATTR_OP);
-      }
-    } else {
-      fuse_reply_err (request, ENOENT);
-    }
+    /* The server has sent less than requested, data would not follow */
+    if (length < FRDP_FUSE_BLOCK_SIZE)
+      break;
   }
 
-  g_mutex_unlock (&priv->fuse_mutex);
+  if (read->error != 0)
+    fuse_reply_err (read->request, read->error);
+  else if (bufvec->count > 0)
+    fuse_reply_data (read->request, bufvec, 0);
+  else
+    fuse_reply_buf (read->request, NULL, 0);
+
+  for (i = 0; i < read->n_blocks; i++)
+    g_clear_pointer (&read->blocks[i], g_bytes_unref);
+  g_free (bufvec);
+  g_free (read);
 }
 
+/* Has to be called with blocks_mutex locked */
 static void
-fuse_open (fuse_req_t             request,
-           fuse_ino_t             inode,
-           struct fuse_file_info *file_info)
+remote_block_remove (FrdpChannelClipboard *self,
+                     FrdpRemoteFileBlock  *block)
 {
-  FrdpChannelClipboard        *self = fuse_req_userdata (request);
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  gssize                       index;
 
-  g_mutex_lock (&priv->fuse_mutex);
-
-  if (inode == FUSE_ROOT_ID) {
-    fuse_reply_err (request, EISDIR);
-  } else {
-    index = get_remote_file_info_index (self, inode);
-    if (index >= 0) {
-      if (priv->remote_files_infos[index].is_directory) {
-        fuse_reply_err (request, EISDIR);
-      } else {
-        file_info->direct_io = 1;
-        fuse_reply_open (request, file_info);
-      }
-    } else {
-      fuse_reply_err (request, ENOENT);
-    }
+  if (block->data != NULL) {
+    g_queue_unlink (&priv->remote_blocks_lru, &block->link);
+    priv->remote_blocks_size -= g_bytes_get_size (block->data);
   }
 
-  g_mutex_unlock (&priv->fuse_mutex);
+  g_hash_table_remove (priv->remote_blocks, block);
 }
 
+/* Has to be called with blocks_mutex locked, the least recently used blocks are dropped */
 static void
-fuse_read (fuse_req_t             request,
-           fuse_ino_t             inode,
-           size_t                 size,
-           off_t                  offset,
-           struct fuse_file_info *file_info)
+remote_block_store (FrdpChannelClipboard *self,
+                    FrdpRemoteFileBlock  *block,
+                    GBytes               *data)
 {
-  FrdpChannelClipboard        *self = fuse_req_userdata (request);
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  gssize                       index;
+  GList                       *last;
 
-  g_mutex_lock (&priv->fuse_mutex);
+  block->data = g_bytes_ref (data);
+  block->link.data = block;
+  g_queue_push_head_link (&priv->remote_blocks_lru, &block->link);
+  priv->remote_blocks_size += g_bytes_get_size (data);
 
-  index = get_remote_file_info_index (self, inode);
-  if (index >= 0) {
-    if (priv->remote_files_infos[index].is_directory) {
-      fuse_reply_err (request, EISDIR);
-    } else {
-      CLIPRDR_FILE_CONTENTS_REQUEST  file_contents_request = { 0 };
-      FrdpRemoteFileRequest         *data_request;
+  while (priv->remote_blocks_size > FRDP_FUSE_BLOCK_CACHE_SIZE &&
+         (last = g_queue_peek_tail_link (&priv->remote_blocks_lru)) != &block->link)
+    remote_block_remove (self, last->data);
+}
 
-      size = MIN (size, 8 * 1024 * 1024);
-      g_assert (size > 0);
+static gboolean
+remote_block_unused (gpointer key,
+                     gpointer value,
+                     gpointer user_data)
+{
+  FrdpChannelClipboardPrivate *priv = user_data;
+  FrdpRemoteFileBlock         *block = key;
 
-      file_contents_request.streamId = priv->next_stream_id++;
-      file_contents_request.listIndex = index;
-      file_contents_request.dwFlags = FILECONTENTS_RANGE;
-      file_contents_request.cbRequested = size;
-      file_contents_request.nPositionHigh = offset >> 32;
-      file_contents_request.nPositionLow = offset & 0xffffffff;
-      file_contents_request.haveClipDataId = TRUE;
-      file_contents_request.clipDataId = priv->remote_clip_data_id;
+  if (block->waiters != NULL)
+    return FALSE;
 
-      data_request = g_new0 (FrdpRemoteFileRequest, 1);
-      data_request->index = index;
-      data_request->request = request;
-      data_request->op = FUSE_READ_OP;
+  if (block->data != NULL) {
+    g_queue_unlink (&priv->remote_blocks_lru, &block->link);
+    priv->remote_blocks_size -= g_bytes_get_size (block->data);
+  }
 
-      g_hash_table_insert (priv->remote_files_requests, GUINT_TO_POINTER (file_contents_request.streamId), data_request);
+  return TRUE;
+}
 
-      priv->cliprdr_client_context->ClientFileContentsRequest (priv->cliprdr_client_context, &file_contents_request);
-    }
-  } else {
-    fuse_reply_err (request, ENOENT);
-  }
+/* Blocks still awaited by readers are kept, their clipDataId is not used anymore */
+static void
+remote_blocks_invalidate (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
 
-  g_mutex_unlock (&priv->fuse_mutex);
+  g_mutex_lock (&priv->blocks_mutex);
+  g_debug ("Remote file block cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+           priv->remote_blocks_hits, priv->remote_blocks_misses);
+  g_hash_table_foreach_remove (priv->remote_blocks, remote_block_unused, priv);
+  g_mutex_unlock (&priv->blocks_mutex);
 }
 
+/*
+ * Serves reads from cached blocks. Blocks ahead of sequential readers are
+ * requested in advance, so that several range requests are in flight at
+ * once instead of one per read().
+ */
 static void
-fuse_opendir (fuse_req_t             request,
-              fuse_ino_t             inode,
-              struct fuse_file_info *file_info)
+read_from_blocks (FrdpChannelClipboard *self,
+                  FrdpRemoteFileHandle *handle,
+                  fuse_req_t            request,
+                  gsize                 index,
+                  guint                 clip_data_id,
+                  guint64               offset,
+                  gsize                 size)
 {
-  FrdpChannelClipboard        *self = fuse_req_userdata (request);
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  gssize                       index;
+  FrdpRemoteFileBlock          key = { 0 };
+  FrdpRemoteFileBlock         *block;
+  FrdpRemoteFileRead          *read;
+  gboolean                     complete;
+  guint64                      missing[G_N_ELEMENTS (read->blocks) + FRDP_FUSE_READAHEAD_BLOCKS];
+  guint64                      first, last_read, last, i;
+  guint                        n_missing = 0;
+
+  if (offset >= handle->size) {
+    fuse_reply_buf (request, NULL, 0);
+    return;
+  }
 
-  g_mutex_lock (&priv->fuse_mutex);
+  size = MIN (size, handle->size - offset);
+  first = offset / FRDP_FUSE_BLOCK_SIZE;
+  last_read = (offset + size - 1) / FRDP_FUSE_BLOCK_SIZE;
+
+  read = g_new0 (FrdpRemoteFileRead, 1);
+  read->request = request;
+  read->offset = offset - first * FRDP_FUSE_BLOCK_SIZE;
+  read->size = size;
+  read->first = first;
+  read->n_blocks = last_read - first + 1;
+
+  g_mutex_lock (&priv->blocks_mutex);
+
+  if (offset == handle->next_offset)
+    handle->sequential_reads++;
+  else
+    handle->sequential_reads = 0;
+  handle->next_offset = offset + size;
+
+  key.clip_data_id = clip_data_id;
+  key.index = index;
+
+  last = last_read;
+  if (handle->sequential_reads >= FRDP_FUSE_SEQUENTIAL_READS)
+    last = MIN (last_read + FRDP_FUSE_READAHEAD_BLOCKS, (handle->size - 1) / FRDP_FUSE_BLOCK_SIZE);
+
+  for (i = first; i <= last; i++) {
+    key.number = i;
+    block = g_hash_table_lookup (priv->remote_blocks, &key);
+    if (block == NULL) {
+      block = g_new0 (FrdpRemoteFileBlock, 1);
+      *block = key;
+      g_hash_table_add (priv->remote_blocks, block);
+      missing[n_missing++] = i;
+    }
 
-  if (inode == FUSE_ROOT_ID) {
-    fuse_reply_open (request, file_info);
-  } else {
-    index = get_remote_file_info_index (self, inode);
-    if (index >= 0) {
-      if (priv->remote_files_infos[index].is_directory) {
-        fuse_reply_open (request, file_info);
-      } else {
-        fuse_reply_err (request, ENOTDIR);
-      }
+    if (i > last_read)
+      continue;
+
+    if (block->data != NULL) {
+      priv->remote_blocks_hits++;
+      g_queue_unlink (&priv->remote_blocks_lru, &block->link);
+      g_queue_push_head_link (&priv->remote_blocks_lru, &block->link);
+      read->blocks[i - first] = g_bytes_ref (block->data);
     } else {
-      fuse_reply_err (request, ENOENT);
+      priv->remote_blocks_misses++;
+      read->pending++;
+      block->waiters = g_list_prepend (block->waiters, read);
     }
   }
 
-  g_mutex_unlock (&priv->fuse_mutex);
-}
+  /* Once unlocked, the read can be replied from server_file_contents_response() */
+  complete = read->pending == 0;
 
-static void
-fuse_readdir (fuse_req_t             request,
-              fuse_ino_t             inode,
-              size_t                 size,
-              off_t                  offset,
-              struct fuse_file_info *file_info)
-{
-  FrdpChannelClipboard        *self = fuse_req_userdata (request);
-  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  struct stat                  attr = {0};
-  gboolean                     done = FALSE;
-  gssize                       index, i, j;
-  GList                       *iter;
-  gsize                        written = 0, entry_size, child_index;
-  char                        *buffer;
+  g_mutex_unlock (&priv->blocks_mutex);
 
-  buffer = g_malloc0 (size);
+  if (complete)
+    reply_read (read);
 
-  g_mutex_lock (&priv->fuse_mutex);
+  for (i = 0; i < n_missing; i++)
+    request_file_contents (self, NULL, index, FUSE_BLOCK_OP, clip_data_id,
+                           missing[i] * FRDP_FUSE_BLOCK_SIZE,
+                           MIN (FRDP_FUSE_BLOCK_SIZE, handle->size - missing[i] * FRDP_FUSE_BLOCK_SIZE));
+}
 
-  if (inode == FUSE_ROOT_ID) {
-    j = -1;
-    for (i = 0; i < priv->remote_files_count; i++) {
-      if (priv->remote_files_infos[i].parent_index == -1) {
-        j++;
-        if (j <= offset && offset > 0)
-          continue;
+static void
+frdp_remote_file_size_free (FrdpRemoteFileSize *size)
+{
+  g_list_free_full (size->waiters, g_free);
+  g_free (size);
+}
 
-        get_file_attributes (priv->remote_files_infos[i], &attr);
+/* Has to be called with requests_mutex locked, queued sizes are moved to indexes while the window allows */
+static void
+take_queued_sizes (FrdpChannelClipboard *self,
+                   GArray               *indexes)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpRemoteFileSize          *size;
+  gsize                        index;
 
-        entry_size = fuse_add_direntry (request, buffer + written,
-                                        size - written,
-                                        priv->remote_files_infos[i].filename, &attr, j + 1);
+  while (priv->remote_sizes_in_flight < FRDP_FUSE_SIZE_REQUESTS &&
+         !g_queue_is_empty (&priv->remote_sizes_queue)) {
+    index = GPOINTER_TO_SIZE (g_queue_pop_head (&priv->remote_sizes_queue));
 
-        if (entry_size > size - written)
-          break;
+    /* Requested already because somebody waits for it */
+    size = g_hash_table_lookup (priv->remote_sizes, GSIZE_TO_POINTER (index));
+    if (size == NULL || size->sent)
+      continue;
 
-        written += entry_size;
+    size->sent = TRUE;
+    priv->remote_sizes_in_flight++;
+    g_array_append_val (indexes, index);
+  }
+}
 
-        if (i == priv->remote_files_count - 1)
-          done = TRUE;
-      }
-    }
-    fuse_reply_buf (request, buffer, written);
-  } else {
-    index = get_remote_file_info_index (self, inode);
-    if (index >= 0) {
-      if (priv->remote_files_infos[index].is_directory) {
-        for (iter = priv->remote_files_infos[index].children, i = 0; iter != NULL; iter = iter->next, i++) {
-          child_index = *((gsize *) iter->data);
+static void
+send_size_requests (FrdpChannelClipboard *self,
+                    guint                 clip_data_id,
+                    GArray               *indexes)
+{
+  guint i;
 
-          if (i <= offset && offset > 0)
-            continue;
+  for (i = 0; i < indexes->len; i++)
+    request_file_contents (self, NULL, g_array_index (indexes, gsize, i), FUSE_SIZE_OP, clip_data_id, 0, 0);
 
-          get_file_attributes (priv->remote_files_infos[child_index], &attr);
+  g_array_unref (indexes);
+}
 
-          entry_size = fuse_add_direntry (request, buffer + written,
-                                          size - written,
-                                          priv->remote_files_infos[child_index].filename, &attr, i + 1);
+/*
+ * Requests sizes of the files, or queues them if too many are in flight
+ * already. A FUSE request waiting for a size is replied once it arrives and
+ * its size is requested regardless of the queue. Must be called without
+ * fuse_lock.
+ */
+static void
+request_file_sizes (FrdpChannelClipboard *self,
+                    fuse_req_t            request,
+                    FrdpFuseOp            op,
+                    const gsize          *indexes,
+                    guint                 n_indexes)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpRemoteFileRequest       *waiter;
+  FrdpRemoteFileSize          *size;
+  GArray                      *send;
+  guint                        clip_data_id, i;
 
-          if (entry_size > size - written)
-            break;
+  send = g_array_new (FALSE, FALSE, sizeof (gsize));
 
-          written += entry_size;
+  g_mutex_lock (&priv->requests_mutex);
 
-          if (iter == NULL)
-            done = TRUE;
-        }
+  for (i = 0; i < n_indexes; i++) {
+    size = g_hash_table_lookup (priv->remote_sizes, GSIZE_TO_POINTER (indexes[i]));
+    if (size == NULL) {
+      size = g_new0 (FrdpRemoteFileSize, 1);
+      g_hash_table_insert (priv->remote_sizes, GSIZE_TO_POINTER (indexes[i]), size);
+      g_queue_push_tail (&priv->remote_sizes_queue, GSIZE_TO_POINTER (indexes[i]));
+    }
 
-        fuse_reply_buf (request, buffer, written);
-      } else {
-        fuse_reply_err (request, ENOTDIR);
+    if (request != NULL) {
+      waiter = g_new0 (FrdpRemoteFileRequest, 1);
+      waiter->index = indexes[i];
+      waiter->request = request;
+      waiter->op = op;
+      size->waiters = g_list_prepend (size->waiters, waiter);
+
+      if (!size->sent) {
+        size->sent = TRUE;
+        priv->remote_sizes_in_flight++;
+        g_array_append_val (send, indexes[i]);
       }
-    } else {
-      fuse_reply_err (request, ENOENT);
     }
   }
 
-  if (done)
-    fuse_reply_buf (request, NULL, 0);
+  take_queued_sizes (self, send);
+  clip_data_id = priv->remote_files_clip_data_id;
 
-  g_mutex_unlock (&priv->fuse_mutex);
+  g_mutex_unlock (&priv->requests_mutex);
 
-  g_free (buffer);
+  send_size_requests (self, clip_data_id, send);
 }
 
-static const struct fuse_lowlevel_ops fuse_ops =
-{
-  .lookup = fuse_lookup,
-  .getattr = fuse_getattr,
-  .open = fuse_open,
-  .read = fuse_read,
-  .opendir = fuse_opendir,
-  .readdir = fuse_readdir,
-};
-
-static gpointer
-fuse_session_thread_func (gpointer data)
+/* Has to be called with fuse_lock locked, returns indexes of files without size */
+static GArray *
+get_unsized_files (FrdpChannelClipboard *self,
+                   GArray               *children)
 {
-  FrdpChannelClipboard        *self = data;
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  gint                         result;
-
-  g_mutex_lock (&priv->fuse_mutex);
-  fuse_session_mount (priv->fuse_session,
-                      priv->fuse_directory);
+  GArray                      *unsized;
+  gsize                        index;
+  guint                        i;
 
-  fuse_daemonize (1);
-  g_mutex_unlock (&priv->fuse_mutex);
+  unsized = g_array_new (FALSE, FALSE, sizeof (gsize));
+  for (i = 0; children != NULL && i < children->len; i++) {
+    index = g_array_index (children, gsize, i);
+    if (!priv->remote_files_infos[index].has_size &&
+        !priv->remote_files_infos[index].is_directory)
+      g_array_append_val (unsized, index);
+  }
 
-  result = fuse_session_loop (priv->fuse_session);
+  return unsized;
+}
 
-  g_mutex_lock (&priv->fuse_mutex);
-  fuse_session_unmount (priv->fuse_session);
-  g_mutex_unlock (&priv->fuse_mutex);
+/* Sizes of files in a listed directory are likely to be asked for soon */
+static void
+prefetch_file_sizes (FrdpChannelClipboard *self,
+                     GArray               *unsized)
+{
+  if (unsized->len > 0)
+    request_file_sizes (self, NULL, FUSE_SIZE_OP, (gsize *) (gpointer) unsized->data, unsized->len);
 
-  return NULL;
+  g_array_unref (unsized);
 }
 
+/*
+ * Has to be called with fuse_lock locked for writing, when remote files are
+ * dropped. Waiters are replied by fail_stale_size_waiters() once unlocked.
+ */
 static void
-frdp_channel_clipboard_init (FrdpChannelClipboard *self)
+clear_remote_sizes (FrdpChannelClipboard *self)
 {
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  struct fuse_args             args = {0};
-  gchar                       *argv[2];
+  FrdpRemoteFileSize          *size;
+  GHashTableIter               iter;
 
-  priv->gtk_clipboard = gtk_clipboard_get (GDK_SELECTION_CLIPBOARD);
-  priv->clipboard_owner_changed_id = g_signal_connect (priv->gtk_clipboard, "owner-change", G_CALLBACK (clipboard_owner_change_cb), self);
-  priv->fgdw_id = FRDP_CLIPBOARD_FORMAT_TEXT_URILIST;
-  priv->current_inode = FUSE_ROOT_ID + 1;
-  priv->locked_data = NULL;
-  priv->pending_lock = FALSE;
-  priv->remote_clip_data_id = 0;
+  g_mutex_lock (&priv->requests_mutex);
 
-  argv[0] = "gnome-connections";
-  argv[1] = "-d";
-  args.argc = 1; /* Set to 2 to see debug logs of Fuse */
-  args.argv = argv;
+  /* Responses of requests in flight are ignored */
+  priv->remote_sizes_generation++;
+  priv->remote_sizes_in_flight = 0;
+  g_queue_clear (&priv->remote_sizes_queue);
 
-  priv->remote_files_requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_hash_table_iter_init (&iter, priv->remote_sizes);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &size)) {
+    priv->stale_size_waiters = g_list_concat (size->waiters, priv->stale_size_waiters);
+    size->waiters = NULL;
+    g_hash_table_iter_remove (&iter);
+  }
 
-  g_mutex_init (&priv->fuse_mutex);
-  g_mutex_init (&priv->lock_mutex);
+  g_mutex_unlock (&priv->requests_mutex);
+}
 
-  priv->fuse_directory = g_mkdtemp (g_strdup_printf ("%s/clipboard-XXXXXX/", g_get_user_runtime_dir ()));
+/* Replies FUSE requests which waited for sizes of dropped remote files */
+static void
+fail_stale_size_waiters (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpRemoteFileRequest       *waiter;
+  GList                       *waiters, *iter;
 
-  priv->fuse_session = fuse_session_new (&args, &fuse_ops, sizeof (fuse_ops), self);
-  if (priv->fuse_session != NULL) {
-    priv->fuse_session_thread = g_thread_new ("RDP FUSE session thread",
-                                              fuse_session_thread_func,
-                                              self);
-  } else {
-    g_warning ("Could not initiate FUSE session\n");
+  g_rw_lock_writer_lock (&priv->fuse_lock);
+  waiters = priv->stale_size_waiters;
+  priv->stale_size_waiters = NULL;
+  g_rw_lock_writer_unlock (&priv->fuse_lock);
+
+  for (iter = waiters; iter != NULL; iter = iter->next) {
+    waiter = iter->data;
+    fuse_reply_err (waiter->request, ENOENT);
   }
 
-  priv->duration = g_new0 (FrdpClipboardDuration, 1);
-  priv->duration->self = self;
-  g_atomic_int_set (&priv->duration->finalized, 0);
+  g_list_free_full (waiters, g_free);
 }
 
+/* Replies FUSE requests waiting for the size, with error if it is not 0 */
 static void
-clipboard_owner_change_cb (GtkClipboard        *clipboard,
-                           GdkEventOwnerChange *event,
-                           gpointer             user_data)
+remote_size_finished (FrdpChannelClipboard  *self,
+                      FrdpRemoteFileRequest *request,
+                      guint64                file_size,
+                      gint                   error)
 {
-  FrdpChannelClipboard        *self = (FrdpChannelClipboard *) user_data;
-  FrdpChannelClipboardPrivate *priv;
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  struct fuse_entry_param      entry = {0};
+  FrdpRemoteFileRequest       *waiter;
+  FrdpRemoteFileSize          *size = NULL;
+  GArray                      *send;
+  GList                       *iter;
+  guint                        clip_data_id;
 
-  if (self != NULL) {
-    priv = frdp_channel_clipboard_get_instance_private (self);
+  send = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+  g_rw_lock_writer_lock (&priv->fuse_lock);
+  g_mutex_lock (&priv->requests_mutex);
+
+  /* Files have been dropped in the meantime */
+  if (request->generation == priv->remote_sizes_generation) {
+    if ((gsize) request->index < priv->remote_files_count) {
+      if (error == 0) {
+        priv->remote_files_infos[request->index].size = file_size;
+        priv->remote_files_infos[request->index].has_size = TRUE;
+      }
+
+      entry.ino = priv->remote_files_infos[request->index].inode;
+      get_file_attributes (priv->remote_files_infos[request->index], &entry.attr);
+
+      size = g_hash_table_lookup (priv->remote_sizes, GSIZE_TO_POINTER (request->index));
+      if (size != NULL)
+        g_hash_table_steal (priv->remote_sizes, GSIZE_TO_POINTER (request->index));
+    }
 
-    if ((gtk_clipboard_wait_is_text_available (clipboard) ||
-         gtk_clipboard_wait_is_image_available (clipboard) ||
-         gtk_clipboard_wait_is_uris_available (clipboard)) &&
-        !priv->remote_data_in_clipboard) {
-      send_client_format_list (self);
+    priv->remote_sizes_in_flight--;
+    take_queued_sizes (self, send);
+  }
+  clip_data_id = priv->remote_files_clip_data_id;
+
+  g_mutex_unlock (&priv->requests_mutex);
+  g_rw_lock_writer_unlock (&priv->fuse_lock);
+
+  if (size != NULL) {
+    entry.attr_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+    entry.entry_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+
+    for (iter = size->waiters; iter != NULL; iter = iter->next) {
+      waiter = iter->data;
+      if (error != 0)
+        fuse_reply_err (waiter->request, error);
+      else if (waiter->op == FUSE_LOOKUP_OP)
+        fuse_reply_entry (waiter->request, &entry);
+      else
+        fuse_reply_attr (waiter->request, &entry.attr, FRDP_FUSE_CACHE_TIMEOUT);
     }
+
+    frdp_remote_file_size_free (size);
   }
+
+  send_size_requests (self, clip_data_id, send);
 }
 
-static guint
-send_client_capabilities (FrdpChannelClipboard *self)
+/*
+ * Finds files of a directory, the subdirectory of the channel stands for the
+ * topmost files.
+ * Returns 0 or an errno value for the reply.
+ */
+static gint
+get_remote_directory (FrdpChannelClipboard  *self,
+                      fuse_ino_t             inode,
+                      GArray               **children,
+                      GHashTable           **children_names)
 {
-  FrdpChannelClipboardPrivate    *priv = frdp_channel_clipboard_get_instance_private (self);
-  CLIPRDR_GENERAL_CAPABILITY_SET  general_capability_set = { 0 };
-  CLIPRDR_CAPABILITIES            capabilities = { 0 };
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  gssize                       index;
 
-  capabilities.cCapabilitiesSets = 1;
-  capabilities.capabilitySets = (CLIPRDR_CAPABILITY_SET *) &(general_capability_set);
+  if (inode == priv->fuse_root_inode) {
+    *children = priv->remote_files_roots;
+    *children_names = priv->remote_files_roots_names;
+    return 0;
+  }
 
-  general_capability_set.capabilitySetType = CB_CAPSTYPE_GENERAL;
-  general_capability_set.capabilitySetLength = 12;
-  general_capability_set.version = CB_CAPS_VERSION_2;
-  general_capability_set.generalFlags = CB_USE_LONG_FORMAT_NAMES |
-                                        CB_STREAM_FILECLIP_ENABLED |
-                                        CB_CAN_LOCK_CLIPDATA |
-                                        CB_FILECLIP_NO_FILE_PATHS |
-                                        CB_HUGE_FILE_SUPPORT_ENABLED;
+  index = get_remote_file_info_index (self, inode);
+  if (index < 0)
+    return ENOENT;
 
-  return priv->cliprdr_client_context->ClientCapabilities (priv->cliprdr_client_context, &capabilities);
+  if (!priv->remote_files_infos[index].is_directory)
+    return ENOTDIR;
+
+  *children = priv->remote_files_infos[index].children;
+  *children_names = priv->remote_files_infos[index].children_names;
+
+  return 0;
 }
 
-static guint
-send_client_format_list (FrdpChannelClipboard *self)
+static void
+fuse_lookup (FrdpChannelClipboard *self,
+             fuse_req_t            request,
+             fuse_ino_t            parent_inode,
+             const char           *name)
 {
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  CLIPRDR_FORMAT_LIST          format_list = { 0 };
-  CLIPRDR_FORMAT              *formats = NULL;
-  guint32                      formats_count = 0;
-  GdkAtom                     *targets = NULL;
-  gchar                       *atom_name;
-  guint                        ret = CHANNEL_RC_NOT_INITIALIZED, k;
-  gint                         targets_count = 0;
-  gint                         i, j = 0;
+  struct fuse_entry_param      entry = {0};
+  GHashTable                  *children_names;
+  GArray                      *children;
+  GArray                      *unsized = NULL;
+  gpointer                     child_index;
+  gssize                       size_index = -1;
+  gsize                        index;
+  gint                         error;
+
+  g_rw_lock_reader_lock (&priv->fuse_lock);
+
+  error = get_remote_directory (self, parent_inode, &children, &children_names);
+  if (error == 0 &&
+      children_names != NULL &&
+      g_hash_table_lookup_extended (children_names, name, NULL, &child_index)) {
+    index = GPOINTER_TO_SIZE (child_index);
+    if (priv->remote_files_infos[index].has_size ||
+        priv->remote_files_infos[index].is_directory) {
+      entry.ino = priv->remote_files_infos[index].inode;
+      get_file_attributes (priv->remote_files_infos[index], &entry.attr);
+      entry.attr_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+      entry.entry_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+
+      if (priv->remote_files_infos[index].is_directory)
+        unsized = get_unsized_files (self, priv->remote_files_infos[index].children);
+    } else {
+      size_index = index;
+    }
+  } else if (error == 0) {
+    /* Missing names are cached too, those in the root are invalidated with the clipboard */
+    if (parent_inode == priv->fuse_root_inode) {
+      g_mutex_lock (&priv->requests_mutex);
+      g_hash_table_add (priv->negative_roots_names, g_strdup (name));
+      g_mutex_unlock (&priv->requests_mutex);
+    }
 
-  /* TODO - change to gtk_clipboard_request_targets() */
-  if (gtk_clipboard_wait_for_targets (priv->gtk_clipboard,
-                                      &targets,
-                                      &targets_count)) {
-    formats_count = targets_count;
-    formats = g_new0 (CLIPRDR_FORMAT, formats_count);
+    entry.ino = 0;
+    entry.entry_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+  }
 
-    for (i = 0; i < targets_count; i++) {
-      atom_name = gdk_atom_name (targets[i]);
+  g_rw_lock_reader_unlock (&priv->fuse_lock);
 
-      if (g_strcmp0 (atom_name, "UTF8_STRING") == 0) {
-        formats[j].formatId = CF_UNICODETEXT;
-        formats[j++].formatName = NULL;
-      } else if (g_strcmp0 (atom_name, "TEXT") == 0) {
-        formats[j].formatId = CF_TEXT;
-        formats[j++].formatName = NULL;
-      } else if (g_strcmp0 (atom_name, "image/png") == 0) {
-        formats[j].formatId = FRDP_CLIPBOARD_FORMAT_PNG;
-        formats[j++].formatName = NULL;
-      } else if (g_strcmp0 (atom_name, "image/jpeg") == 0) {
-        formats[j].formatId = FRDP_CLIPBOARD_FORMAT_JPEG;
-        formats[j++].formatName = NULL;
-      } else if (g_strcmp0 (atom_name, "image/bmp") == 0) {
-        formats[j].formatId = CF_DIB;
-        formats[j++].formatName = NULL;
-      } else if (g_strcmp0 (atom_name, "text/uri-list") == 0) {
-        formats[j].formatId = priv->fgdw_id;
-        formats[j++].formatName = g_strdup ("FileGroupDescriptorW");
-      }
+  if (error != 0) {
+    fuse_reply_err (request, error);
+  } else if (size_index >= 0) {
+    index = size_index;
+    request_file_sizes (self, request, FUSE_LOOKUP_OP, &index, 1);
+  } else {
+    fuse_reply_entry (request, &entry);
+  }
 
-      g_free (atom_name);
+  if (unsized != NULL)
+    prefetch_file_sizes (self, unsized);
+}
+
+static void
+fuse_getattr (FrdpChannelClipboard *self,
+              fuse_req_t            request,
+              fuse_ino_t            inode)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  struct stat                  attr = {0};
+  gssize                       index, size_index = -1;
+  gsize                        file_index;
+  gint                         error = 0;
+
+  g_rw_lock_reader_lock (&priv->fuse_lock);
+
+  if (inode == priv->fuse_root_inode) {
+    get_root_attributes (inode, &attr);
+  } else {
+    index = get_remote_file_info_index (self, inode);
+    if (index >= 0) {
+      if (priv->remote_files_infos[index].has_size ||
+          priv->remote_files_infos[index].is_directory)
+        get_file_attributes (priv->remote_files_infos[index], &attr);
+      else
+        size_index = index;
+    } else {
+      error = ENOENT;
     }
   }
 
-  format_list.COMMON(msgType) = CB_FORMAT_LIST;
-  format_list.numFormats = j;
-  format_list.formats = formats;
+  g_rw_lock_reader_unlock (&priv->fuse_lock);
 
-  priv->awaiting_data_request = TRUE;
-  ret = priv->cliprdr_client_context->ClientFormatList (priv->cliprdr_client_context, &format_list);
+  if (error != 0) {
+    fuse_reply_err (request, error);
+  } else if (size_index >= 0) {
+    file_index = size_index;
+    request_file_sizes (self, request, FUSE_GETATTR_OP, &file_index, 1);
+  } else {
+    fuse_reply_attr (request, &attr, FRDP_FUSE_CACHE_TIMEOUT);
+  }
+}
 
-  if (formats != NULL) {
-    for (k = 0; k < formats_count; k++) {
-      g_free (formats[k].formatName);
+static void
+fuse_open (FrdpChannelClipboard  *self,
+           fuse_req_t             request,
+           fuse_ino_t             inode,
+           struct fuse_file_info *file_info)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpRemoteFileHandle        *handle = NULL;
+  gssize                       index;
+  gint                         error = 0;
+
+  g_rw_lock_reader_lock (&priv->fuse_lock);
+
+  if (inode == priv->fuse_root_inode) {
+    error = EISDIR;
+  } else {
+    index = get_remote_file_info_index (self, inode);
+    if (index < 0) {
+      error = ENOENT;
+    } else if (priv->remote_files_infos[index].is_directory) {
+      error = EISDIR;
+    } else if (priv->remote_files_infos[index].has_size) {
+      /* Remote files do not change until the clipboard does, so the page cache can be kept */
+      handle = g_new0 (FrdpRemoteFileHandle, 1);
+      handle->size = priv->remote_files_infos[index].size;
+      file_info->fh = (uint64_t) (guintptr) handle;
+      file_info->keep_cache = 1;
+    } else {
+      file_info->direct_io = 1;
     }
-    g_free (formats);
   }
 
-  return ret;
+  g_rw_lock_reader_unlock (&priv->fuse_lock);
+
+  if (error != 0)
+    fuse_reply_err (request, error);
+  else if (fuse_reply_open (request, file_info) != 0)
+    g_free (handle);
 }
 
-static guint
-server_capabilities (CliprdrClientContext       *context,
-                     const CLIPRDR_CAPABILITIES *capabilities)
+static void
+fuse_read (FrdpChannelClipboard  *self,
+           fuse_req_t             request,
+           fuse_ino_t             inode,
+           size_t                 size,
+           off_t                  offset,
+           struct fuse_file_info *file_info)
 {
-  FrdpChannelClipboard        *self;
-  FrdpChannelClipboardPrivate *priv;
-  CLIPRDR_CAPABILITY_SET      *capability;
-  guint                        i;
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpRemoteFileHandle        *handle = (FrdpRemoteFileHandle *) (guintptr) file_info->fh;
+  gssize                       index, read_index = -1;
+  guint                        clip_data_id;
+  gint                         error = 0;
 
-  if (context != NULL) {
-    self = (FrdpChannelClipboard *) context->custom;
-    priv = frdp_channel_clipboard_get_instance_private (self);
+  g_rw_lock_reader_lock (&priv->fuse_lock);
 
-    for (i = 0; i < capabilities->cCapabilitiesSets; i++) {
-      capability = &(capabilities->capabilitySets[i]);
+  index = get_remote_file_info_index (self, inode);
+  if (index < 0)
+    error = ENOENT;
+  else if (priv->remote_files_infos[index].is_directory)
+    error = EISDIR;
+  else
+    read_index = index;
 
-      if (capability->capabilitySetType == CB_CAPSTYPE_GENERAL) {
-        CLIPRDR_GENERAL_CAPABILITY_SET *general_capability = (CLIPRDR_GENERAL_CAPABILITY_SET *) capability;
+  /* The index is valid for the files of this clipDataId only */
+  clip_data_id = priv->remote_files_clip_data_id;
 
-        /* Windows 7 does not send files if these flags are disabled. */
-        if (general_capability->generalFlags & CB_USE_LONG_FORMAT_NAMES &&
-            general_capability->generalFlags & CB_STREAM_FILECLIP_ENABLED &&
-            general_capability->generalFlags & CB_FILECLIP_NO_FILE_PATHS) {
-          priv->file_streams_supported = TRUE;
-        }
-      }
-    }
+  g_rw_lock_reader_unlock (&priv->fuse_lock);
+
+  if (error != 0) {
+    fuse_reply_err (request, error);
+  } else {
+    size = MIN (size, FRDP_FUSE_MAX_READ);
+    g_assert (size > 0);
+
+    if (handle != NULL)
+      read_from_blocks (self, handle, request, read_index, clip_data_id, offset, size);
+    else
+      request_file_contents (self, request, read_index, FUSE_READ_OP, clip_data_id, offset, size);
   }
+}
 
-  return CHANNEL_RC_OK;
+static void
+fuse_release (fuse_req_t             request,
+              fuse_ino_t             inode,
+              struct fuse_file_info *file_info)
+{
+  g_free ((FrdpRemoteFileHandle *) (guintptr) file_info->fh);
+
+  fuse_reply_err (request, 0);
 }
 
-static guint
-send_data_request (FrdpChannelClipboard *self,
-                   guint32               format_id)
+static void
+fuse_opendir (FrdpChannelClipboard  *self,
+              fuse_req_t             request,
+              fuse_ino_t             inode,
+              struct fuse_file_info *file_info)
 {
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  CLIPRDR_FORMAT_DATA_REQUEST *new_request;
+  GArray                      *unsized = NULL;
+  gssize                       index;
+  gint                         error = 0;
 
-  new_request = g_new0 (CLIPRDR_FORMAT_DATA_REQUEST, 1);
-  new_request->requestedFormatId = format_id;
+  g_rw_lock_reader_lock (&priv->fuse_lock);
 
-  return priv->cliprdr_client_context->ClientFormatDataRequest (priv->cliprdr_client_context, new_request);
-}
+  if (inode == priv->fuse_root_inode) {
+    unsized = get_unsized_files (self, priv->remote_files_roots);
+  } else {
+    index = get_remote_file_info_index (self, inode);
+    if (index < 0)
+      error = ENOENT;
+    else if (!priv->remote_files_infos[index].is_directory)
+      error = ENOTDIR;
+    else
+      unsized = get_unsized_files (self, priv->remote_files_infos[index].children);
+  }
 
-static FrdpClipboardRequest *
-frdp_clipboard_request_new (guint count)
-{
-  FrdpClipboardRequest *request;
+  g_rw_lock_reader_unlock (&priv->fuse_lock);
 
-  request = g_new0 (FrdpClipboardRequest, 1);
-  request->count = count;
-  request->requested_ids = g_new0 (guint, count);
-  request->responses = g_new0 (FrdpClipboardResponseData, count);
+  if (error != 0)
+    fuse_reply_err (request, error);
+  else
+    fuse_reply_open (request, file_info);
 
-  return request;
+  if (unsized != NULL)
+    prefetch_file_sizes (self, unsized);
 }
 
-static FrdpClipboardRequest *
-frdp_clipboard_request_send (FrdpChannelClipboard *self,
-                             guint                 format_id)
+/*
+ * Offsets are indexes of the next file in the directory. The plus variant
+ * passes attributes as well so that the kernel does not need to look up
+ * each file. Sizes which are not known yet are requested on opendir.
+ */
+static void
+fuse_readdir (FrdpChannelClipboard *self,
+              fuse_req_t            request,
+              fuse_ino_t            inode,
+              size_t                size,
+              off_t                 offset,
+              gboolean              plus)
 {
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  FrdpClipboardRequest        *request = NULL;
-  guint                        i;
+  struct fuse_entry_param      entry;
+  FrdpRemoteFileInfo          *info;
+  GHashTable                  *children_names;
+  GArray                      *children;
+  gsize                        written = 0, entry_size, i;
+  char                        *buffer;
+  gint                         error;
+
+  g_rw_lock_reader_lock (&priv->fuse_lock);
+
+  error = get_remote_directory (self, inode, &children, &children_names);
+  if (error != 0) {
+    g_rw_lock_reader_unlock (&priv->fuse_lock);
+    fuse_reply_err (request, error);
+    return;
+  }
+
+  buffer = g_malloc0 (size);
+
+  for (i = MAX (offset, 0); children != NULL && i < children->len; i++) {
+    info = &priv->remote_files_infos[g_array_index (children, gsize, i)];
+
+    memset (&entry, 0, sizeof (entry));
+    entry.ino = info->inode;
+    get_file_attributes (*info, &entry.attr);
 
-  if (format_id == priv->fgdw_id) {
-    request = frdp_clipboard_request_new (1);
-    request->requested_ids[0] = priv->fgdw_id;
-  } else if (format_id == CF_UNICODETEXT) {
-    request = frdp_clipboard_request_new (1);
-    request->requested_ids[0] = CF_UNICODETEXT;
-  } else if (format_id == CF_DIB) {
-    request = frdp_clipboard_request_new (1);
-    request->requested_ids[0] = CF_DIB;
-  }
-
-  if (request != NULL) {
-    priv->requests = g_list_append (priv->requests, request);
-    for (i = 0; i < request->count; i++) {
-      send_data_request (self, request->requested_ids[i]);
+    if (plus) {
+      entry.attr_timeout = info->has_size || info->is_directory ? FRDP_FUSE_CACHE_TIMEOUT : 0.0;
+      entry.entry_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+      entry_size = fuse_add_direntry_plus (request, buffer + written,
+                                           size - written,
+                                           info->filename, &entry, i + 1);
+    } else {
+      entry_size = fuse_add_direntry (request, buffer + written,
+                                      size - written,
+                                      info->filename, &entry.attr, i + 1);
     }
+
+    if (entry_size > size - written)
+      break;
+
+    written += entry_size;
   }
 
-  return request;
+  g_rw_lock_reader_unlock (&priv->fuse_lock);
+
+  /* An empty reply marks the end of the directory */
+  fuse_reply_buf (request, buffer, written);
+
+  g_free (buffer);
 }
 
-static gboolean
-frdp_clipboard_request_done (FrdpClipboardRequest *request)
+static void
+fuse_init (gpointer               user_data,
+           struct fuse_conn_info *connection)
 {
-  guint i;
+  /* Reads made of more blocks are spliced instead of being merged into one buffer */
+  if (connection->capable & FUSE_CAP_SPLICE_WRITE)
+    connection->want |= FUSE_CAP_SPLICE_WRITE;
+}
 
-  for (i = 0; i < request->count; i++) {
-    if (!request->responses[i].handled) {
-      return FALSE;
-    }
+/*
+ * The channel owning the inode. It is counted as being served, so that no
+ * lock has to be held meanwhile and frdp_channel_clipboard_detach() waits
+ * for the worker. Has to be released by fuse_mount_release_channel().
+ */
+static FrdpChannelClipboard *
+fuse_mount_get_channel (FrdpFuseMount *mount,
+                        fuse_ino_t     inode)
+{
+  FrdpChannelClipboardPrivate *priv;
+  FrdpChannelClipboard        *channel;
+
+  g_rw_lock_reader_lock (&mount->lock);
+  channel = g_hash_table_lookup (mount->channels, GUINT_TO_POINTER (inode >> 32));
+  if (channel != NULL) {
+    priv = frdp_channel_clipboard_get_instance_private (channel);
+    g_atomic_int_inc (&priv->fuse_workers);
+  }
+  g_rw_lock_reader_unlock (&mount->lock);
+
+  return channel;
+}
+
+static void
+fuse_mount_release_channel (FrdpFuseMount        *mount,
+                            FrdpChannelClipboard *channel)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (channel);
+
+  g_mutex_lock (&mount->workers_mutex);
+  if (g_atomic_int_dec_and_test (&priv->fuse_workers))
+    g_cond_broadcast (&mount->workers_cond);
+  g_mutex_unlock (&mount->workers_mutex);
+}
+
+static void
+fuse_mount_lookup (fuse_req_t  request,
+                   fuse_ino_t  parent_inode,
+                   const char *name)
+{
+  FrdpFuseMount          *mount = fuse_req_userdata (request);
+  FrdpChannelClipboard   *channel;
+  struct fuse_entry_param entry = {0};
+  gboolean                found;
+  gchar                  *end;
+  guint64                 id;
+
+  if (parent_inode == FUSE_ROOT_ID) {
+    /* Subdirectories of channels are named by their ids */
+    id = g_ascii_strtoull (name, &end, 10);
+    found = *name != '\0' && *end == '\0' && id <= G_MAXUINT;
+    if (found) {
+      g_rw_lock_reader_lock (&mount->lock);
+      found = g_hash_table_contains (mount->channels, GUINT_TO_POINTER (id));
+      g_rw_lock_reader_unlock (&mount->lock);
+    }
+
+    if (found) {
+      entry.ino = (id << 32) + FUSE_ROOT_ID;
+      get_root_attributes (entry.ino, &entry.attr);
+      entry.attr_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+      entry.entry_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+
+      fuse_reply_entry (request, &entry);
+    } else {
+      fuse_reply_err (request, ENOENT);
+    }
+  } else if ((channel = fuse_mount_get_channel (mount, parent_inode)) != NULL) {
+    fuse_lookup (channel, request, parent_inode, name);
+    fuse_mount_release_channel (mount, channel);
+  } else {
+    fuse_reply_err (request, ENOENT);
+  }
+}
+
+static void
+fuse_mount_getattr (fuse_req_t             request,
+                    fuse_ino_t             inode,
+                    struct fuse_file_info *file_info)
+{
+  FrdpFuseMount        *mount = fuse_req_userdata (request);
+  FrdpChannelClipboard *channel;
+  struct stat           attr;
+
+  if (inode == FUSE_ROOT_ID) {
+    get_root_attributes (inode, &attr);
+    fuse_reply_attr (request, &attr, FRDP_FUSE_CACHE_TIMEOUT);
+  } else if ((channel = fuse_mount_get_channel (mount, inode)) != NULL) {
+    fuse_getattr (channel, request, inode);
+    fuse_mount_release_channel (mount, channel);
+  } else {
+    fuse_reply_err (request, ENOENT);
+  }
+}
+
+static void
+fuse_mount_open (fuse_req_t             request,
+                 fuse_ino_t             inode,
+                 struct fuse_file_info *file_info)
+{
+  FrdpFuseMount        *mount = fuse_req_userdata (request);
+  FrdpChannelClipboard *channel;
+
+  if (inode == FUSE_ROOT_ID) {
+    fuse_reply_err (request, EISDIR);
+  } else if ((channel = fuse_mount_get_channel (mount, inode)) != NULL) {
+    fuse_open (channel, request, inode, file_info);
+    fuse_mount_release_channel (mount, channel);
+  } else {
+    fuse_reply_err (request, ENOENT);
+  }
+}
+
+static void
+fuse_mount_read (fuse_req_t             request,
+                 fuse_ino_t             inode,
+                 size_t                 size,
+                 off_t                  offset,
+                 struct fuse_file_info *file_info)
+{
+  FrdpFuseMount        *mount = fuse_req_userdata (request);
+  FrdpChannelClipboard *channel;
+
+  channel = fuse_mount_get_channel (mount, inode);
+  if (channel != NULL) {
+    fuse_read (channel, request, inode, size, offset, file_info);
+    fuse_mount_release_channel (mount, channel);
+  } else {
+    fuse_reply_err (request, ENOENT);
+  }
+}
+
+static void
+fuse_mount_opendir (fuse_req_t             request,
+                    fuse_ino_t             inode,
+                    struct fuse_file_info *file_info)
+{
+  FrdpFuseMount        *mount = fuse_req_userdata (request);
+  FrdpChannelClipboard *channel;
+
+  if (inode == FUSE_ROOT_ID) {
+    fuse_reply_open (request, file_info);
+  } else if ((channel = fuse_mount_get_channel (mount, inode)) != NULL) {
+    fuse_opendir (channel, request, inode, file_info);
+    fuse_mount_release_channel (mount, channel);
+  } else {
+    fuse_reply_err (request, ENOENT);
+  }
+}
+
+static gint
+compare_channel_ids (gconstpointer a,
+                     gconstpointer b)
+{
+  guint id_a = GPOINTER_TO_UINT (a);
+  guint id_b = GPOINTER_TO_UINT (b);
+
+  return id_a < id_b ? -1 : id_a > id_b;
+}
+
+/* Lists subdirectories of channels, offsets are positions in the list sorted by ids */
+static void
+fuse_mount_readdir_root (FrdpFuseMount *mount,
+                         fuse_req_t     request,
+                         size_t         size,
+                         off_t          offset,
+                         gboolean       plus)
+{
+  struct fuse_entry_param entry;
+  GList                  *ids, *iter;
+  gsize                   written = 0, entry_size, i;
+  gchar                  *buffer, *name;
+
+  g_rw_lock_reader_lock (&mount->lock);
+  ids = g_list_sort (g_hash_table_get_keys (mount->channels), compare_channel_ids);
+  g_rw_lock_reader_unlock (&mount->lock);
+
+  buffer = g_malloc0 (size);
+
+  for (iter = g_list_nth (ids, MAX (offset, 0)), i = MAX (offset, 0); iter != NULL; iter = iter->next, i++) {
+    memset (&entry, 0, sizeof (entry));
+    entry.ino = ((fuse_ino_t) GPOINTER_TO_UINT (iter->data) << 32) + FUSE_ROOT_ID;
+    get_root_attributes (entry.ino, &entry.attr);
+    name = g_strdup_printf ("%u", GPOINTER_TO_UINT (iter->data));
+
+    if (plus) {
+      entry.attr_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+      entry.entry_timeout = FRDP_FUSE_CACHE_TIMEOUT;
+      entry_size = fuse_add_direntry_plus (request, buffer + written,
+                                           size - written,
+                                           name, &entry, i + 1);
+    } else {
+      entry_size = fuse_add_direntry (request, buffer + written,
+                                      size - written,
+                                      name, &entry.attr, i + 1);
+    }
+
+    g_free (name);
+
+    if (entry_size > size - written)
+      break;
+
+    written += entry_size;
+  }
+
+  fuse_reply_buf (request, buffer, written);
+
+  g_list_free (ids);
+  g_free (buffer);
+}
+
+static void
+fuse_mount_readdir_common (fuse_req_t request,
+                           fuse_ino_t inode,
+                           size_t     size,
+                           off_t      offset,
+                           gboolean   plus)
+{
+  FrdpFuseMount        *mount = fuse_req_userdata (request);
+  FrdpChannelClipboard *channel;
+
+  if (inode == FUSE_ROOT_ID) {
+    fuse_mount_readdir_root (mount, request, size, offset, plus);
+  } else if ((channel = fuse_mount_get_channel (mount, inode)) != NULL) {
+    fuse_readdir (channel, request, inode, size, offset, plus);
+    fuse_mount_release_channel (mount, channel);
+  } else {
+    fuse_reply_err (request, ENOENT);
+  }
+}
+
+static void
+fuse_mount_readdir (fuse_req_t             request,
+                    fuse_ino_t             inode,
+                    size_t                 size,
+                    off_t                  offset,
+                    struct fuse_file_info *file_info)
+{
+  fuse_mount_readdir_common (request, inode, size, offset, FALSE);
+}
+
+static void
+fuse_mount_readdirplus (fuse_req_t             request,
+                        fuse_ino_t             inode,
+                        size_t                 size,
+                        off_t                  offset,
+                        struct fuse_file_info *file_info)
+{
+  fuse_mount_readdir_common (request, inode, size, offset, TRUE);
+}
+
+static const struct fuse_lowlevel_ops fuse_ops =
+{
+  .init = fuse_init,
+  .lookup = fuse_mount_lookup,
+  .getattr = fuse_mount_getattr,
+  .open = fuse_mount_open,
+  .read = fuse_mount_read,
+  .release = fuse_release,
+  .opendir = fuse_mount_opendir,
+  .readdir = fuse_mount_readdir,
+  .readdirplus = fuse_mount_readdirplus,
+};
+
+static gpointer
+fuse_mount_thread_func (gpointer data)
+{
+  FrdpFuseMount           *mount = data;
+  struct fuse_loop_config  config;
+
+  /* Reads of several files can wait for the server at the same time */
+  config.clone_fd = 0;
+  config.max_idle_threads = FRDP_FUSE_MAX_IDLE_THREADS;
+  fuse_session_loop_mt (mount->session, &config);
+
+  return NULL;
+}
+
+static FrdpFuseMount *
+fuse_mount_ref (FrdpFuseMount *mount)
+{
+  g_atomic_int_inc (&mount->ref_count);
+
+  return mount;
+}
+
+static void
+fuse_mount_unref (FrdpFuseMount *mount)
+{
+  if (!g_atomic_int_dec_and_test (&mount->ref_count))
+    return;
+
+  if (mount->session != NULL)
+    fuse_session_destroy (mount->session);
+  if (mount->directory != NULL)
+    g_rmdir (mount->directory);
+  g_free (mount->directory);
+  g_hash_table_unref (mount->channels);
+  g_rw_lock_clear (&mount->lock);
+  g_mutex_clear (&mount->workers_mutex);
+  g_cond_clear (&mount->workers_cond);
+  g_free (mount);
+}
+
+/* Called when the last channel leaves, workers can still run until the thread is joined */
+static void
+fuse_mount_stop (FrdpFuseMount *mount)
+{
+  fuse_session_exit (mount->session);
+  fuse_session_unmount (mount->session);
+  g_thread_join (mount->thread);
+  mount->thread = NULL;
+}
+
+static gpointer
+fuse_invalidation_thread_func (gpointer data)
+{
+  FrdpFuseInvalidation *invalidation = data;
+  const gchar          *name;
+  guint                 i;
+
+  for (i = 0; i < invalidation->names->len; i++) {
+    name = g_ptr_array_index (invalidation->names, i);
+    fuse_lowlevel_notify_inval_entry (invalidation->mount->session, invalidation->parent, name, strlen (name));
+  }
+  fuse_lowlevel_notify_inval_inode (invalidation->mount->session, invalidation->parent, 0, 0);
+
+  fuse_mount_unref (invalidation->mount);
+  g_ptr_array_unref (invalidation->names);
+  g_free (invalidation);
+
+  return NULL;
+}
+
+/*
+ * Tells the kernel to forget the names. The kernel waits for lookups in the
+ * parent directory to finish first, and those can wait for the main thread,
+ * so this is done from another thread.
+ */
+static void
+fuse_mount_invalidate (FrdpFuseMount *mount,
+                       fuse_ino_t     parent,
+                       GPtrArray     *names)
+{
+  FrdpFuseInvalidation *invalidation;
+
+  if (names->len == 0)
+    return;
+
+  invalidation = g_new0 (FrdpFuseInvalidation, 1);
+  invalidation->mount = fuse_mount_ref (mount);
+  invalidation->parent = parent;
+  invalidation->names = g_ptr_array_ref (names);
+  g_thread_unref (g_thread_new ("RDP FUSE invalidation thread",
+                                fuse_invalidation_thread_func,
+                                invalidation));
+}
+
+static FrdpFuseMount *
+fuse_mount_new (void)
+{
+  FrdpFuseMount    *mount;
+  struct fuse_args  args = {0};
+  gchar            *argv[2];
+
+  argv[0] = "gnome-connections";
+  argv[1] = "-d";
+  args.argc = 1; /* Set to 2 to see debug logs of Fuse */
+  args.argv = argv;
+
+  mount = g_new0 (FrdpFuseMount, 1);
+  mount->ref_count = 1;
+  mount->channels = g_hash_table_new (g_direct_hash, g_direct_equal);
+  mount->next_id = 1;
+  g_rw_lock_init (&mount->lock);
+  g_mutex_init (&mount->workers_mutex);
+  g_cond_init (&mount->workers_cond);
+
+  mount->directory = g_mkdtemp (g_strdup_printf ("%s/clipboard-XXXXXX", g_get_user_runtime_dir ()));
+  if (mount->directory != NULL)
+    mount->session = fuse_session_new (&args, &fuse_ops, sizeof (fuse_ops), mount);
+
+  if (mount->session == NULL || fuse_session_mount (mount->session, mount->directory) != 0) {
+    g_warning ("Could not initiate FUSE session\n");
+    fuse_mount_unref (mount);
+    return NULL;
+  }
+
+  fuse_daemonize (1);
+
+  mount->thread = g_thread_new ("RDP FUSE session thread",
+                                fuse_mount_thread_func,
+                                mount);
+
+  return mount;
+}
+
+/*
+ * Files of all channels are served by one FUSE mount, which is created once
+ * the first file list is pasted. Each channel has its own subdirectory and
+ * inodes, those carry the channel id in their upper half.
+ */
+static gboolean
+frdp_channel_clipboard_mount (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpFuseMount               *mount;
+
+  if (priv->fuse_mount != NULL)
+    return TRUE;
+
+  if (priv->detached)
+    return FALSE;
+
+  G_LOCK (fuse_mount);
+
+  if (fuse_mount == NULL)
+    fuse_mount = fuse_mount_new ();
+
+  mount = fuse_mount;
+  if (mount != NULL) {
+    g_rw_lock_writer_lock (&mount->lock);
+
+    priv->fuse_mount = fuse_mount_ref (mount);
+    priv->fuse_mount_id = mount->next_id++;
+    priv->fuse_root_inode = ((fuse_ino_t) priv->fuse_mount_id << 32) + FUSE_ROOT_ID;
+    priv->current_inode = priv->fuse_root_inode + 1;
+    priv->fuse_directory = g_strdup_printf ("%s/%u", mount->directory, priv->fuse_mount_id);
+    g_hash_table_insert (mount->channels, GUINT_TO_POINTER (priv->fuse_mount_id), self);
+
+    g_rw_lock_writer_unlock (&mount->lock);
+  }
+
+  G_UNLOCK (fuse_mount);
+
+  return mount != NULL;
+}
+
+/*
+ * No worker serves the channel and no request of it is pending anymore
+ * afterwards, the mount stops if no channel is left.
+ */
+static void
+frdp_channel_clipboard_unmount (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpFuseMount               *mount = priv->fuse_mount;
+  GPtrArray                   *names;
+  gboolean                     last;
+
+  if (mount == NULL)
+    return;
+
+  G_LOCK (fuse_mount);
+
+  g_rw_lock_writer_lock (&mount->lock);
+  g_hash_table_remove (mount->channels, GUINT_TO_POINTER (priv->fuse_mount_id));
+  last = g_hash_table_size (mount->channels) == 0;
+  g_rw_lock_writer_unlock (&mount->lock);
+
+  g_mutex_lock (&mount->workers_mutex);
+  while (g_atomic_int_get (&priv->fuse_workers) > 0)
+    g_cond_wait (&mount->workers_cond, &mount->workers_mutex);
+  g_mutex_unlock (&mount->workers_mutex);
+
+  /*
+   * Nobody would reply to pending requests anymore and the session could be
+   * destroyed below. Sizes are dropped first, so that failed size requests do
+   * not send queued ones.
+   */
+  g_rw_lock_writer_lock (&priv->fuse_lock);
+  clear_remote_sizes (self);
+  g_rw_lock_writer_unlock (&priv->fuse_lock);
+  fail_file_requests (self, 0, EIO);
+  fail_stale_size_waiters (self);
+
+  if (last) {
+    fuse_mount = NULL;
+    fuse_mount_stop (mount);
+    fuse_mount_unref (mount);
+  } else {
+    /* The subdirectory is gone */
+    names = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_add (names, g_strdup_printf ("%u", priv->fuse_mount_id));
+    fuse_mount_invalidate (mount, FUSE_ROOT_ID, names);
+    g_ptr_array_unref (names);
+  }
+
+  G_UNLOCK (fuse_mount);
+
+  priv->fuse_mount = NULL;
+  fuse_mount_unref (mount);
+}
+
+static void
+frdp_channel_clipboard_init (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+
+  priv->gtk_clipboard = gtk_clipboard_get (GDK_SELECTION_CLIPBOARD);
+  priv->clipboard_owner_changed_id = g_signal_connect (priv->gtk_clipboard, "owner-change", G_CALLBACK (clipboard_owner_change_cb), self);
+  priv->fgdw_id = FRDP_CLIPBOARD_FORMAT_TEXT_URILIST;
+  priv->locked_data = NULL;
+  priv->pending_lock = FALSE;
+  priv->remote_clip_data_id = 0;
+  priv->requests = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                          NULL, (GDestroyNotify) frdp_clipboard_request_free);
+  priv->pending_responses = g_queue_new ();
+  priv->remote_cache = g_queue_new ();
+  priv->local_responses = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                 NULL, (GDestroyNotify) g_bytes_unref);
+  priv->requests_cancellable = g_cancellable_new ();
+  priv->request_timeout = FRDP_CLIPBOARD_DEFAULT_TIMEOUT;
+  priv->max_data_size = FRDP_CLIPBOARD_DEFAULT_MAX_SIZE;
+
+  priv->remote_files_requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->remote_blocks = g_hash_table_new_full (remote_block_hash, remote_block_equal,
+                                               (GDestroyNotify) remote_block_free, NULL);
+  g_queue_init (&priv->remote_blocks_lru);
+  priv->remote_sizes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                              NULL, (GDestroyNotify) frdp_remote_file_size_free);
+  g_queue_init (&priv->remote_sizes_queue);
+  priv->negative_roots_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  g_rw_lock_init (&priv->fuse_lock);
+  g_mutex_init (&priv->requests_mutex);
+  g_mutex_init (&priv->blocks_mutex);
+  g_mutex_init (&priv->lock_mutex);
+
+  priv->duration = g_new0 (FrdpClipboardDuration, 1);
+  priv->duration->self = self;
+  g_atomic_int_set (&priv->duration->finalized, 0);
+}
+
+/* Order of targets differs between owners, so they are sorted first */
+static gchar *
+compute_targets_checksum (GdkAtom *atoms,
+                          gint     n_atoms)
+{
+  GdkAtom *sorted;
+  gchar   *checksum;
+  gint     i, j;
+
+  sorted = g_new (GdkAtom, n_atoms);
+  for (i = 0; i < n_atoms; i++) {
+    for (j = i; j > 0 && sorted[j - 1] > atoms[i]; j--)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = atoms[i];
+  }
+
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *) sorted, n_atoms * sizeof (GdkAtom));
+  g_free (sorted);
+
+  return checksum;
+}
+
+/*
+ * Finds the targets whose contents identify the local clipboard content, one
+ * for each announced kind of data. Images are too large to be fetched just
+ * for comparison, so content with images is not fingerprinted at all.
+ * Returns the number of targets stored in fingerprint_targets.
+ */
+static guint
+get_fingerprint_targets (GdkAtom *atoms,
+                         gint     n_atoms,
+                         GdkAtom  fingerprint_targets[2])
+{
+  const gchar *names[] = { "text/uri-list", "UTF8_STRING" };
+  GdkAtom      atom;
+  guint        i, n_targets = 0;
+  gint         j;
+
+  if (gtk_targets_include_image (atoms, n_atoms, FALSE))
+    return 0;
+
+  for (i = 0; i < G_N_ELEMENTS (names); i++) {
+    atom = gdk_atom_intern_static_string (names[i]);
+    for (j = 0; j < n_atoms; j++) {
+      if (atoms[j] == atom) {
+        fingerprint_targets[n_targets++] = atom;
+        break;
+      }
+    }
+  }
+
+  return n_targets;
+}
+
+static void
+announce_local_content (FrdpChannelClipboard *self,
+                        gchar                *targets_checksum)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+
+  priv->local_generation++;
+  g_hash_table_remove_all (priv->local_responses);
+
+  g_free (priv->announced_targets_checksum);
+  priv->announced_targets_checksum = targets_checksum;
+  g_clear_pointer (&priv->announced_content_checksum, g_free);
+
+  send_client_format_list (self);
+}
+
+static void
+local_content_fingerprint_received (GtkClipboard     *clipboard,
+                                    GtkSelectionData *selection_data,
+                                    gpointer          user_data)
+{
+  FrdpClipboardLocalRequest   *content_request = user_data;
+  FrdpChannelClipboard        *self;
+  FrdpChannelClipboardPrivate *priv;
+  const guchar                *data;
+  gchar                       *content_checksum = NULL;
+  gint                         length;
+
+  if (g_atomic_int_get (&content_request->duration->finalized))
+    goto out;
+
+  self = content_request->duration->self;
+  priv = frdp_channel_clipboard_get_instance_private (self);
+
+  if (content_request->serial != priv->targets_serial ||
+      priv->remote_data_in_clipboard)
+    goto out;
+
+  /* Content is not known without data of every target */
+  data = gtk_selection_data_get_data_with_length (selection_data, &length);
+  if (data != NULL && length >= 0) {
+    /* Lengths separate the contents of the targets */
+    g_checksum_update (content_request->checksum, (const guchar *) &length, sizeof (length));
+    g_checksum_update (content_request->checksum, data, length);
+
+    if (++content_request->fingerprint_index < content_request->n_fingerprint_targets) {
+      gtk_clipboard_request_contents (priv->gtk_clipboard,
+                                      content_request->fingerprint_targets[content_request->fingerprint_index],
+                                      local_content_fingerprint_received,
+                                      content_request);
+      return;
+    }
+
+    content_checksum = g_strdup (g_checksum_get_string (content_request->checksum));
+  }
+
+  if (!content_request->announced) {
+    /* The same content again, e.g. a clipboard manager took over the selection */
+    if (content_checksum != NULL &&
+        g_strcmp0 (content_checksum, priv->announced_content_checksum) == 0) {
+      g_free (content_checksum);
+      goto out;
+    }
+
+    announce_local_content (self, g_strdup (priv->announced_targets_checksum));
+  }
+
+  g_free (priv->announced_content_checksum);
+  priv->announced_content_checksum = content_checksum;
+
+out:
+  g_checksum_free (content_request->checksum);
+  g_free (content_request);
+}
+
+static void
+local_targets_received (GtkClipboard *clipboard,
+                        GdkAtom      *atoms,
+                        gint          n_atoms,
+                        gpointer      user_data)
+{
+  FrdpClipboardLocalRequest   *targets_request = user_data;
+  FrdpChannelClipboard        *self;
+  FrdpChannelClipboardPrivate *priv;
+  gchar                       *targets_checksum;
+
+  if (g_atomic_int_get (&targets_request->duration->finalized))
+    goto out;
+
+  self = targets_request->duration->self;
+  priv = frdp_channel_clipboard_get_instance_private (self);
+
+  /* The clipboard has changed again in the meantime */
+  if (targets_request->serial != priv->targets_serial ||
+      priv->remote_data_in_clipboard)
+    goto out;
+
+  g_clear_pointer (&priv->local_targets, g_free);
+  priv->local_targets_count = 0;
+  if (atoms != NULL && n_atoms > 0) {
+    priv->local_targets = g_new (GdkAtom, n_atoms);
+    memcpy (priv->local_targets, atoms, n_atoms * sizeof (GdkAtom));
+    priv->local_targets_count = n_atoms;
+  }
+
+  if (gtk_targets_include_text (atoms, n_atoms) ||
+      gtk_targets_include_image (atoms, n_atoms, FALSE) ||
+      gtk_targets_include_uri (atoms, n_atoms)) {
+    targets_checksum = compute_targets_checksum (atoms, n_atoms);
+    targets_request->n_fingerprint_targets = get_fingerprint_targets (atoms, n_atoms,
+                                                                      targets_request->fingerprint_targets);
+
+    /*
+     * New targets are announced right away and their content is fingerprinted
+     * afterwards. Known targets are announced only if the content differs.
+     */
+    targets_request->announced = targets_request->n_fingerprint_targets == 0 ||
+                                 g_strcmp0 (targets_checksum, priv->announced_targets_checksum) != 0;
+    if (targets_request->announced)
+      announce_local_content (self, targets_checksum);
+    else
+      g_free (targets_checksum);
+
+    if (targets_request->n_fingerprint_targets > 0) {
+      targets_request->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+      gtk_clipboard_request_contents (priv->gtk_clipboard,
+                                      targets_request->fingerprint_targets[0],
+                                      local_content_fingerprint_received,
+                                      targets_request);
+      return;
+    }
+  }
+
+out:
+  g_free (targets_request);
+}
+
+static gboolean
+request_local_targets (gpointer user_data)
+{
+  FrdpChannelClipboard        *self = user_data;
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpClipboardLocalRequest *targets_request;
+
+  priv->owner_change_timeout_id = 0;
+
+  targets_request = g_new0 (FrdpClipboardLocalRequest, 1);
+  targets_request->duration = priv->duration;
+  targets_request->serial = ++priv->targets_serial;
+
+  gtk_clipboard_request_targets (priv->gtk_clipboard,
+                                 local_targets_received,
+                                 targets_request);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+clipboard_owner_change_cb (GtkClipboard        *clipboard,
+                           GdkEventOwnerChange *event,
+                           gpointer             user_data)
+{
+  FrdpChannelClipboard        *self = (FrdpChannelClipboard *) user_data;
+  FrdpChannelClipboardPrivate *priv;
+
+  if (self != NULL) {
+    priv = frdp_channel_clipboard_get_instance_private (self);
+
+    if (priv->remote_data_in_clipboard)
+      return;
+
+    if (priv->owner_change_timeout_id != 0)
+      g_source_remove (priv->owner_change_timeout_id);
+    priv->owner_change_timeout_id = g_timeout_add (FRDP_CLIPBOARD_OWNER_CHANGE_DELAY,
+                                                   request_local_targets,
+                                                   self);
+  }
+}
+
+static guint
+send_client_capabilities (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate    *priv = frdp_channel_clipboard_get_instance_private (self);
+  CLIPRDR_GENERAL_CAPABILITY_SET  general_capability_set = { 0 };
+  CLIPRDR_CAPABILITIES            capabilities = { 0 };
+
+  capabilities.cCapabilitiesSets = 1;
+  capabilities.capabilitySets = (CLIPRDR_CAPABILITY_SET *) &(general_capability_set);
+
+  general_capability_set.capabilitySetType = CB_CAPSTYPE_GENERAL;
+  general_capability_set.capabilitySetLength = 12;
+  general_capability_set.version = CB_CAPS_VERSION_2;
+  general_capability_set.generalFlags = CB_USE_LONG_FORMAT_NAMES |
+                                        CB_STREAM_FILECLIP_ENABLED |
+                                        CB_CAN_LOCK_CLIPDATA |
+                                        CB_FILECLIP_NO_FILE_PATHS |
+                                        CB_HUGE_FILE_SUPPORT_ENABLED;
+
+  return priv->cliprdr_client_context->ClientCapabilities (priv->cliprdr_client_context, &capabilities);
+}
+
+static guint
+send_client_format_list (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  CLIPRDR_FORMAT_LIST          format_list = { 0 };
+  CLIPRDR_FORMAT              *formats = NULL;
+  guint32                      formats_count = 0;
+  GdkAtom                     *targets = priv->local_targets;
+  gchar                       *atom_name;
+  guint                        ret = CHANNEL_RC_NOT_INITIALIZED, k;
+  gint                         targets_count = priv->local_targets_count;
+  gboolean                     has_dib = FALSE, has_html = FALSE, has_rtf = FALSE;
+  gint                         i, j = 0;
+
+  /* Targets are cached by local_targets_received() */
+  if (targets != NULL) {
+    /* Space for CF_DIB and CF_DIBV5 converted from any image */
+    formats_count = targets_count + 2;
+    formats = g_new0 (CLIPRDR_FORMAT, formats_count);
+
+    for (i = 0; i < targets_count; i++) {
+      atom_name = gdk_atom_name (targets[i]);
+
+      if (g_strcmp0 (atom_name, "UTF8_STRING") == 0) {
+        formats[j].formatId = CF_UNICODETEXT;
+        formats[j++].formatName = NULL;
+      } else if (g_strcmp0 (atom_name, "TEXT") == 0) {
+        formats[j].formatId = CF_TEXT;
+        formats[j++].formatName = NULL;
+      } else if (g_strcmp0 (atom_name, "image/png") == 0) {
+        formats[j].formatId = FRDP_CLIPBOARD_FORMAT_PNG;
+        formats[j++].formatName = NULL;
+      } else if (g_strcmp0 (atom_name, "image/jpeg") == 0) {
+        formats[j].formatId = FRDP_CLIPBOARD_FORMAT_JPEG;
+        formats[j++].formatName = NULL;
+      } else if (g_strcmp0 (atom_name, "image/bmp") == 0) {
+        formats[j].formatId = CF_DIB;
+        formats[j++].formatName = NULL;
+        has_dib = TRUE;
+      } else if (g_strcmp0 (atom_name, "text/uri-list") == 0) {
+        formats[j].formatId = priv->fgdw_id;
+        formats[j++].formatName = g_strdup ("FileGroupDescriptorW");
+      } else if (g_strcmp0 (atom_name, "text/html") == 0 && !has_html) {
+        /* Only announced, the CF_HTML header is added when the server asks for it */
+        formats[j].formatId = FRDP_CLIPBOARD_FORMAT_HTML;
+        formats[j++].formatName = g_strdup ("HTML Format");
+        has_html = TRUE;
+      } else if ((g_strcmp0 (atom_name, "text/rtf") == 0 ||
+                  g_strcmp0 (atom_name, "application/rtf") == 0 ||
+                  g_strcmp0 (atom_name, "text/richtext") == 0) && !has_rtf) {
+        formats[j].formatId = FRDP_CLIPBOARD_FORMAT_RTF;
+        formats[j++].formatName = g_strdup ("Rich Text Format");
+        has_rtf = TRUE;
+      }
+
+      g_free (atom_name);
+    }
+
+    /* Windows applications understand mostly these */
+    if (gtk_targets_include_image (targets, targets_count, FALSE)) {
+      if (!has_dib) {
+        formats[j].formatId = CF_DIB;
+        formats[j++].formatName = NULL;
+      }
+      formats[j].formatId = CF_DIBV5;
+      formats[j++].formatName = NULL;
+    }
+  }
+
+  format_list.COMMON(msgType) = CB_FORMAT_LIST;
+  format_list.numFormats = j;
+  format_list.formats = formats;
+
+  priv->awaiting_data_request = TRUE;
+  ret = priv->cliprdr_client_context->ClientFormatList (priv->cliprdr_client_context, &format_list);
+
+  if (formats != NULL) {
+    for (k = 0; k < formats_count; k++) {
+      g_free (formats[k].formatName);
+    }
+    g_free (formats);
+  }
+
+  return ret;
+}
+
+static guint
+server_capabilities (CliprdrClientContext       *context,
+                     const CLIPRDR_CAPABILITIES *capabilities)
+{
+  FrdpChannelClipboard        *self;
+  FrdpChannelClipboardPrivate *priv;
+  CLIPRDR_CAPABILITY_SET      *capability;
+  guint                        i;
+
+  if (context != NULL) {
+    self = (FrdpChannelClipboard *) context->custom;
+    priv = frdp_channel_clipboard_get_instance_private (self);
+
+    for (i = 0; i < capabilities->cCapabilitiesSets; i++) {
+      capability = &(capabilities->capabilitySets[i]);
+
+      if (capability->capabilitySetType == CB_CAPSTYPE_GENERAL) {
+        CLIPRDR_GENERAL_CAPABILITY_SET *general_capability = (CLIPRDR_GENERAL_CAPABILITY_SET *) capability;
+
+        /* Windows 7 does not send files if these flags are disabled. */
+        if (general_capability->generalFlags & CB_USE_LONG_FORMAT_NAMES &&
+            general_capability->generalFlags & CB_STREAM_FILECLIP_ENABLED &&
+            general_capability->generalFlags & CB_FILECLIP_NO_FILE_PATHS) {
+          priv->file_streams_supported = TRUE;
+        }
+      }
+    }
+  }
+
+  return CHANNEL_RC_OK;
+}
+
+static guint
+send_data_request (FrdpChannelClipboard *self,
+                   guint32               format_id)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  CLIPRDR_FORMAT_DATA_REQUEST  new_request = { 0 };
+
+  new_request.requestedFormatId = format_id;
+
+  return priv->cliprdr_client_context->ClientFormatDataRequest (priv->cliprdr_client_context, &new_request);
+}
+
+static FrdpClipboardRequest *
+frdp_clipboard_request_new (guint count)
+{
+  FrdpClipboardRequest *request;
+
+  request = g_new0 (FrdpClipboardRequest, 1);
+  request->count = count;
+  request->requested_ids = g_new0 (guint, count);
+  request->responses = g_new0 (FrdpClipboardResponseData, count);
+
+  return request;
+}
+
+static gboolean
+frdp_clipboard_format_supported (FrdpChannelClipboard *self,
+                                 guint                 format_id)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+
+  return format_id == priv->fgdw_id ||
+         (format_id != 0 && format_id == priv->remote_html_id) ||
+         (format_id != 0 && format_id == priv->remote_rtf_id) ||
+         format_id == CF_UNICODETEXT ||
+         format_id == CF_DIB ||
+         format_id == CF_DIBV5 ||
+         format_id == FRDP_CLIPBOARD_FORMAT_PNG ||
+         format_id == FRDP_CLIPBOARD_FORMAT_JPEG;
+}
+
+static void
+frdp_clipboard_transfer_emit_progress (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  gdouble                      rate = 0.0;
+  gint64                       elapsed;
+
+  priv->progress_time = g_get_monotonic_time ();
+
+  elapsed = priv->transfer_last_time - priv->transfer_start_time;
+  if (elapsed > 0)
+    rate = (gdouble) priv->transfer_bytes * G_USEC_PER_SEC / elapsed;
+
+  g_signal_emit (self, signals[TRANSFER_PROGRESS], 0, priv->transfer_bytes, rate);
+}
+
+static gboolean
+frdp_clipboard_transfer_progress_timeout (gpointer user_data)
+{
+  FrdpChannelClipboard        *self = user_data;
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+
+  priv->progress_timeout_id = 0;
+  frdp_clipboard_transfer_emit_progress (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Starts a new transfer unless data have been moving recently */
+static void
+frdp_clipboard_transfer_start (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  gint64                       now = g_get_monotonic_time ();
+
+  if (priv->transfer_last_time == 0 ||
+      now - priv->transfer_last_time > FRDP_CLIPBOARD_TRANSFER_IDLE) {
+    priv->transfer_start_time = now;
+    priv->transfer_bytes = 0;
+    priv->progress_time = 0;
+  }
+
+  priv->transfer_last_time = now;
+}
+
+/* Accounts transferred data, progress is signalled at most every FRDP_CLIPBOARD_PROGRESS_INTERVAL */
+static void
+frdp_clipboard_transfer_add (FrdpChannelClipboard *self,
+                             gsize                 bytes)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+
+  if (bytes == 0)
+    return;
+
+  frdp_clipboard_transfer_start (self);
+  priv->transfer_bytes += bytes;
+
+  if (priv->progress_timeout_id != 0)
+    return;
+
+  if (priv->progress_time != 0 &&
+      priv->transfer_last_time - priv->progress_time < FRDP_CLIPBOARD_PROGRESS_INTERVAL * 1000) {
+    priv->progress_timeout_id = g_timeout_add (FRDP_CLIPBOARD_PROGRESS_INTERVAL,
+                                               frdp_clipboard_transfer_progress_timeout,
+                                               self);
+    return;
+  }
+
+  frdp_clipboard_transfer_emit_progress (self);
+}
+
+static gboolean
+frdp_clipboard_exceeds_max_size (FrdpChannelClipboard *self,
+                                 gsize                 size)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+
+  if (priv->max_data_size > 0 && size > priv->max_data_size) {
+    g_warning ("Clipboard data of %" G_GSIZE_FORMAT " bytes exceed the limit of %u bytes!", size, priv->max_data_size);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/*
+ * Sends one Format Data Request PDU per format. The protocol does not
+ * identify responses, they come in the order of requests, so each sent
+ * PDU is queued in pending_responses together with the id of its request.
+ * Requests are independent of each other, any number of them can be
+ * in flight.
+ */
+static FrdpClipboardRequest *
+frdp_clipboard_request_send (FrdpChannelClipboard *self,
+                             const guint          *format_ids,
+                             guint                 count)
+{
+  FrdpChannelClipboardPrivate  *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpClipboardPendingResponse *pending;
+  FrdpClipboardRequest         *request;
+  guint                         i, j = 0;
+
+  for (i = 0; i < count; i++) {
+    if (frdp_clipboard_format_supported (self, format_ids[i]))
+      j++;
+  }
+
+  if (j == 0)
+    return NULL;
+
+  request = frdp_clipboard_request_new (j);
+  request->id = ++priv->next_request_id;
+  request->cancellable = g_object_ref (priv->requests_cancellable);
+  for (i = 0, j = 0; i < count; i++) {
+    if (frdp_clipboard_format_supported (self, format_ids[i]))
+      request->requested_ids[j++] = format_ids[i];
+  }
+
+  g_hash_table_insert (priv->requests, GUINT_TO_POINTER (request->id), request);
+
+  for (i = 0; i < request->count; i++) {
+    if (send_data_request (self, request->requested_ids[i]) == CHANNEL_RC_OK) {
+      pending = g_new (FrdpClipboardPendingResponse, 1);
+      pending->request_id = request->id;
+      pending->index = i;
+      g_queue_push_tail (priv->pending_responses, pending);
+    } else {
+      request->responses[i].handled = TRUE;
+    }
+  }
+
+  return request;
+}
+
+static gboolean
+frdp_clipboard_request_done (FrdpClipboardRequest *request)
+{
+  guint i;
+
+  for (i = 0; i < request->count; i++) {
+    if (!request->responses[i].handled) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static void
+frdp_clipboard_request_cancelled (GCancellable *cancellable,
+                                  gpointer      user_data)
+{
+  FrdpClipboardRequest *request = user_data;
+
+  if (request->loop != NULL)
+    g_main_loop_quit (request->loop);
+}
+
+static gboolean
+frdp_clipboard_request_timeout (gpointer user_data)
+{
+  FrdpClipboardRequest *request = user_data;
+
+  request->timed_out = TRUE;
+  request->timeout_id = 0;
+
+  if (request->loop != NULL)
+    g_main_loop_quit (request->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * GtkClipboardGetFunc has to provide the data before it returns, so this
+ * waits in a nested main loop (the widget keeps drawing in the meantime)
+ * until server_format_data_response() completes the request, the request
+ * times out or the remote clipboard content changes.
+ *
+ * The channel can be finalized while waiting, callers have to check
+ * their FrdpClipboardDuration before touching the request again.
+ */
+static void
+frdp_clipboard_request_wait (FrdpChannelClipboard *self,
+                             FrdpClipboardRequest *request)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  GMainLoop                   *loop;
+
+  if (frdp_clipboard_request_done (request) ||
+      g_cancellable_is_cancelled (request->cancellable))
+    return;
+
+  loop = g_main_loop_new (NULL, FALSE);
+  request->loop = loop;
+  request->cancelled_id = g_cancellable_connect (request->cancellable,
+                                                 G_CALLBACK (frdp_clipboard_request_cancelled),
+                                                 request, NULL);
+  if (priv->request_timeout > 0)
+    request->timeout_id = g_timeout_add (priv->request_timeout,
+                                         frdp_clipboard_request_timeout,
+                                         request);
+
+  g_main_loop_run (loop);
+  g_main_loop_unref (loop);
+
+  if (g_atomic_int_get (&priv->duration->finalized))
+    return;
+
+  request->loop = NULL;
+  if (request->timeout_id != 0) {
+    g_source_remove (request->timeout_id);
+    request->timeout_id = 0;
+  }
+  g_cancellable_disconnect (request->cancellable, request->cancelled_id);
+  request->cancelled_id = 0;
+}
+
+/* Makes pending waits give up, their responses will be dropped once they come. */
+static void
+frdp_clipboard_requests_cancel (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+
+  g_cancellable_cancel (priv->requests_cancellable);
+  g_object_unref (priv->requests_cancellable);
+  priv->requests_cancellable = g_cancellable_new ();
+}
+
+static void
+frdp_clipboard_request_free (FrdpClipboardRequest *request)
+{
+  guint i;
+
+  if (request->loop != NULL)
+    g_main_loop_quit (request->loop);
+  if (request->timeout_id != 0) {
+    g_source_remove (request->timeout_id);
+    request->timeout_id = 0;
+  }
+  if (request->cancelled_id != 0)
+    g_cancellable_disconnect (request->cancellable, request->cancelled_id);
+  g_clear_object (&request->cancellable);
+
+  g_free (request->requested_ids);
+  for (i = 0; i < request->count; i++)
+    g_clear_pointer (&request->responses[i].data, g_bytes_unref);
+  g_free (request->responses);
+  g_free (request);
+}
+
+static guint
+send_client_format_list_response (FrdpChannelClipboard *self,
+                                  gboolean              status)
+{
+  CLIPRDR_FORMAT_LIST_RESPONSE  response = { 0 };
+  FrdpChannelClipboardPrivate  *priv = frdp_channel_clipboard_get_instance_private (self);
+
+  response.COMMON(msgType) = CB_FORMAT_LIST_RESPONSE;
+  response.COMMON(msgFlags) = status ? CB_RESPONSE_OK : CB_RESPONSE_FAIL;
+  response.COMMON(dataLen) = 0;
+
+  return priv->cliprdr_client_context->ClientFormatListResponse (priv->cliprdr_client_context, &response);
+}
+
+static void
+replace_ascii_character (gchar *text,
+                         gchar  old_character,
+                         gchar  new_character)
+{
+  guint i;
+
+  for (i = 0; text[i] != '\0'; i++) {
+    if (text[i] == old_character)
+      text[i] = new_character;
+  }
+}
+
+static WCHAR *
+convert_to_unicode (const gchar *text)
+{
+  WCHAR *result = NULL;
+
+  if (text != NULL) {
+#ifdef HAVE_FREERDP3
+    result = ConvertUtf8ToWCharAlloc (text, NULL);
+#else
+    ConvertToUnicode (CP_UTF8, 0, (LPCSTR) text, -1, &result, 0);
+#endif
+  }
+
+  return result;
+}
+
+static gchar *
+convert_from_unicode (const WCHAR *text,
+                      gint         text_length)
+{
+  gchar *result = NULL;
+
+  if (text != NULL) {
+#ifdef HAVE_FREERDP3
+    result = ConvertWCharNToUtf8Alloc (text, text_length, NULL);
+#else
+    ConvertFromUnicode (CP_UTF8, 0, text, text_length, &result, 0, NULL, NULL);
+#endif
+  }
+
+  return result;
+}
+
+static gunichar2 *
+text_converter_put_utf16 (gunichar2 *out,
+                          gunichar   code)
+{
+  if (code >= 0x10000) {
+    code -= 0x10000;
+    *out++ = GUINT16_TO_LE (0xD800 + (code >> 10));
+    *out++ = GUINT16_TO_LE (0xDC00 + (code & 0x3FF));
+  } else {
+    *out++ = GUINT16_TO_LE (code);
+  }
+
+  return out;
+}
+
+/*
+ * Converts a chunk of UTF-8 text with LF line endings to UTF-16LE with CR LF,
+ * stops at NUL. The output has to hold FRDP_TEXT_UTF16_LENGTH (length) units.
+ * Returns the number of units written.
+ */
+static gsize
+text_converter_utf8_to_utf16 (FrdpTextConverter *converter,
+                              const guchar      *input,
+                              gsize              length,
+                              gunichar2         *output)
+{
+  gunichar2 *out = output;
+  gunichar   code;
+  guint64    word;
+  guchar     c;
+  gsize      i = 0;
+  guint      j;
+
+  while (i < length && !converter->terminated) {
+    /* Runs of ASCII without NUL, CR and LF are widened 8 bytes at a time */
+    if (converter->needed == 0) {
+      while (length - i >= 8) {
+        memcpy (&word, input + i, sizeof (word));
+        if ((word & G_GUINT64_CONSTANT (0x8080808080808080)) != 0 ||
+            FRDP_TEXT_HAS_ZERO_BYTE (word) ||
+            FRDP_TEXT_HAS_ZERO_BYTE (word ^ G_GUINT64_CONSTANT (0x0A0A0A0A0A0A0A0A)) ||
+            FRDP_TEXT_HAS_ZERO_BYTE (word ^ G_GUINT64_CONSTANT (0x0D0D0D0D0D0D0D0D)))
+          break;
+
+        for (j = 0; j < 8; j++)
+          out[j] = GUINT16_TO_LE (input[i + j]);
+        out += 8;
+        i += 8;
+        converter->after_cr = FALSE;
+      }
+
+      if (i == length)
+        break;
+    }
+
+    c = input[i++];
+
+    if (converter->needed > 0) {
+      if ((c & 0xC0) == 0x80) {
+        converter->partial = (converter->partial << 6) | (c & 0x3F);
+        if (--converter->needed > 0)
+          continue;
+
+        code = converter->partial;
+        if (code < converter->minimum || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+          code = 0xFFFD;
+        out = text_converter_put_utf16 (out, code);
+        continue;
+      }
+
+      /* Truncated sequence, the byte starts a new one */
+      *out++ = GUINT16_TO_LE (0xFFFD);
+      converter->needed = 0;
+    }
+
+    if (c == '\0') {
+      converter->terminated = TRUE;
+    } else if (c < 0x80) {
+      if (c == '\n' && !converter->after_cr)
+        *out++ = GUINT16_TO_LE ('\r');
+      *out++ = GUINT16_TO_LE (c);
+    } else if ((c & 0xE0) == 0xC0) {
+      converter->partial = c & 0x1F;
+      converter->minimum = 0x80;
+      converter->needed = 1;
+    } else if ((c & 0xF0) == 0xE0) {
+      converter->partial = c & 0x0F;
+      converter->minimum = 0x800;
+      converter->needed = 2;
+    } else if ((c & 0xF8) == 0xF0) {
+      converter->partial = c & 0x07;
+      converter->minimum = 0x10000;
+      converter->needed = 3;
+    } else {
+      *out++ = GUINT16_TO_LE (0xFFFD);
+    }
+
+    converter->after_cr = c == '\r';
+  }
+
+  return out - output;
+}
+
+static gsize
+text_converter_utf8_to_utf16_finish (FrdpTextConverter *converter,
+                                     gunichar2         *output)
+{
+  if (converter->needed > 0) {
+    converter->needed = 0;
+    output[0] = GUINT16_TO_LE (0xFFFD);
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Converts a chunk of UTF-16LE text with CR LF line endings to UTF-8 with LF,
+ * stops at NUL. The output has to hold FRDP_TEXT_UTF8_LENGTH (length) bytes.
+ * Returns the number of bytes written.
+ */
+static gsize
+text_converter_utf16_to_utf8 (FrdpTextConverter *converter,
+                              const gunichar2   *input,
+                              gsize              length,
+                              gchar             *output)
+{
+  gchar   *out = output;
+  guint64  word;
+  gunichar unit;
+  gsize    i = 0;
+  guint    j;
+
+  while (i < length && !converter->terminated) {
+    /* Runs of ASCII without NUL and CR are narrowed 4 units at a time */
+    if (converter->needed == 0 && !converter->after_cr) {
+      while (length - i >= 4) {
+        memcpy (&word, input + i, sizeof (word));
+        word = GUINT64_FROM_LE (word);
+        if ((word & G_GUINT64_CONSTANT (0xFF80FF80FF80FF80)) != 0 ||
+            FRDP_TEXT_HAS_ZERO_UNIT (word) ||
+            FRDP_TEXT_HAS_ZERO_UNIT (word ^ G_GUINT64_CONSTANT (0x000D000D000D000D)))
+          break;
+
+        for (j = 0; j < 4; j++)
+          out[j] = (gchar) (word >> (16 * j));
+        out += 4;
+        i += 4;
+      }
+
+      if (i == length)
+        break;
+    }
+
+    unit = GUINT16_FROM_LE (input[i++]);
+
+    /* CR LF becomes LF, other CRs are kept */
+    if (converter->after_cr) {
+      converter->after_cr = FALSE;
+      if (unit == '\n') {
+        *out++ = '\n';
+        continue;
+      }
+      *out++ = '\r';
+    }
+
+    if (converter->needed > 0) {
+      converter->needed = 0;
+      if (unit >= 0xDC00 && unit <= 0xDFFF) {
+        out += g_unichar_to_utf8 (0x10000 + ((converter->partial - 0xD800) << 10) + (unit - 0xDC00), out);
+        continue;
+      }
+
+      /* Unpaired high surrogate */
+      out += g_unichar_to_utf8 (0xFFFD, out);
+    }
+
+    if (unit == 0) {
+      converter->terminated = TRUE;
+    } else if (unit == '\r') {
+      converter->after_cr = TRUE;
+    } else if (unit < 0x80) {
+      *out++ = unit;
+    } else if (unit >= 0xD800 && unit <= 0xDBFF) {
+      converter->partial = unit;
+      converter->needed = 1;
+    } else if (unit >= 0xDC00 && unit <= 0xDFFF) {
+      out += g_unichar_to_utf8 (0xFFFD, out);
+    } else {
+      out += g_unichar_to_utf8 (unit, out);
+    }
+  }
+
+  return out - output;
+}
+
+static gsize
+text_converter_utf16_to_utf8_finish (FrdpTextConverter *converter,
+                                     gchar             *output)
+{
+  gchar *out = output;
+
+  if (converter->after_cr) {
+    converter->after_cr = FALSE;
+    *out++ = '\r';
+  }
+
+  if (converter->needed > 0) {
+    converter->needed = 0;
+    out += g_unichar_to_utf8 (0xFFFD, out);
+  }
+
+  return out - output;
+}
+
+/* Returns NUL terminated CF_UNICODETEXT data, the length includes the NUL */
+static gunichar2 *
+convert_text_to_unicode (const gchar *text,
+                         gsize        text_length,
+                         gsize       *length)
+{
+  FrdpTextConverter converter = { 0 };
+  gunichar2        *result;
+  gsize             n;
+
+  result = g_new (gunichar2, FRDP_TEXT_UTF16_LENGTH (text_length) + 1);
+  n = text_converter_utf8_to_utf16 (&converter, (const guchar *) text, text_length, result);
+  n += text_converter_utf8_to_utf16_finish (&converter, result + n);
+  result[n++] = 0;
+
+  *length = n * sizeof (gunichar2);
+
+  return result;
+}
+
+/* Returns NUL terminated UTF-8 text from CF_UNICODETEXT data */
+static gchar *
+convert_text_from_unicode (const gunichar2 *text,
+                           gsize            text_length,
+                           gsize           *length)
+{
+  FrdpTextConverter converter = { 0 };
+  gchar            *result;
+  gsize             n;
+
+  result = g_new (gchar, FRDP_TEXT_UTF8_LENGTH (text_length) + 1);
+  n = text_converter_utf16_to_utf8 (&converter, text, text_length, result);
+  n += text_converter_utf16_to_utf8_finish (&converter, result + n);
+  result[n] = '\0';
+
+  *length = n;
+
+  return result;
+}
+
+/* Offset of pixel data in a DIB, i.e. size of the header, color masks and palette */
+static gsize
+get_dib_pixels_offset (const BITMAPINFOHEADER *bi)
+{
+  gsize offset = bi->biSize;
+  guint colors = bi->biClrUsed;
+
+  if (bi->biCompression == FRDP_BI_BITFIELDS && bi->biSize == sizeof (BITMAPINFOHEADER))
+    offset += 3 * sizeof (guint32);
+
+  if (colors == 0 && bi->biBitCount <= 8)
+    colors = 1 << bi->biBitCount;
+
+  return offset + colors * sizeof (guint32);
+}
+
+static gint64
+get_cf_html_offset (const gchar *header,
+                    const gchar *header_end,
+                    const gchar *key)
+{
+  const gchar *line, *eol;
+  gsize        key_length = strlen (key);
+
+  for (line = header; line < header_end; line = eol + 1) {
+    eol = memchr (line, '\n', header_end - line);
+    if (eol == NULL)
+      break;
+
+    if ((gsize) (eol - line) > key_length && strncmp (line, key, key_length) == 0)
+      return g_ascii_strtoll (line + key_length, NULL, 10);
+  }
+
+  return -1;
+}
+
+/*
+ * Finds the HTML in CF_HTML data. Its header consists of "Key:value" lines,
+ * the offsets count bytes from the start of the data. The whole document is
+ * preferred over the fragment as it carries styles as well.
+ */
+static gboolean
+parse_cf_html (const gchar *data,
+               gsize        length,
+               gsize       *start,
+               gsize       *end)
+{
+  const gchar *header_end;
+  gint64       start_offset, end_offset;
+
+  header_end = memchr (data, '<', length);
+  if (header_end == NULL)
+    return FALSE;
+
+  start_offset = get_cf_html_offset (data, header_end, "StartHTML:");
+  end_offset = get_cf_html_offset (data, header_end, "EndHTML:");
+  if (start_offset < 0 || end_offset <= start_offset || end_offset > (gint64) length) {
+    start_offset = get_cf_html_offset (data, header_end, "StartFragment:");
+    end_offset = get_cf_html_offset (data, header_end, "EndFragment:");
+  }
+
+  if (start_offset < 0 || end_offset <= start_offset || end_offset > (gint64) length)
+    return FALSE;
+
+  *start = start_offset;
+  *end = end_offset;
+
+  return TRUE;
+}
+
+/* Wraps local HTML, which is UTF-8 or UTF-16 with BOM, into NUL terminated CF_HTML data */
+static gchar *
+convert_html_to_cf_html (const guchar *html,
+                         gsize         html_length,
+                         gsize        *length)
+{
+  const gchar  prefix[] = "<html>\r\n<body>\r\n<!--StartFragment-->";
+  const gchar  suffix[] = "<!--EndFragment-->\r\n</body>\r\n</html>";
+  const gchar *fragment = (const gchar *) html;
+  gchar       *converted = NULL, *result;
+  glong        converted_length;
+  gsize        fragment_length = html_length, header_length, start_fragment, end_fragment, end_html;
+
+  if (html_length >= 2 && html[0] == 0xFF && html[1] == 0xFE) {
+    converted = g_utf16_to_utf8 ((const gunichar2 *) (html + 2), (html_length - 2) / 2, NULL, &converted_length, NULL);
+    if (converted == NULL)
+      return NULL;
+    fragment = converted;
+    fragment_length = converted_length;
+  } else if (html_length >= 3 && html[0] == 0xEF && html[1] == 0xBB && html[2] == 0xBF) {
+    fragment += 3;
+    fragment_length -= 3;
+  }
+
+  header_length = strlen (FRDP_CF_HTML_HEADER) - 4 * strlen ("%010" G_GSIZE_FORMAT) + 4 * 10;
+  start_fragment = header_length + strlen (prefix);
+  end_fragment = start_fragment + fragment_length;
+  end_html = end_fragment + strlen (suffix);
+
+  result = g_malloc (end_html + 1);
+  g_snprintf (result, header_length + 1, FRDP_CF_HTML_HEADER,
+              header_length, end_html, start_fragment, end_fragment);
+  memcpy (result + header_length, prefix, strlen (prefix));
+  memcpy (result + start_fragment, fragment, fragment_length);
+  memcpy (result + end_fragment, suffix, strlen (suffix));
+  result[end_html] = '\0';
+
+  g_free (converted);
+
+  *length = end_html + 1;
+
+  return result;
+}
+
+/* This has been inspired by function transmute_cf_dib_to_image_bmp() from gtk */
+static guchar *
+convert_dib_to_bmp (const guchar *dib,
+                    gsize         dib_length,
+                    gsize        *length)
+{
+  const BITMAPINFOHEADER *bi = (const BITMAPINFOHEADER *) dib;
+  BITMAPFILEHEADER       *bf;
+  guchar                 *data;
+
+  if (dib_length < sizeof (BITMAPINFOHEADER))
+    return NULL;
+
+  *length = dib_length + sizeof (BITMAPFILEHEADER);
+  data = g_malloc (*length);
+
+  bf = (BITMAPFILEHEADER *) data;
+  bf->bfType = 0x4d42; /* "BM" */
+  bf->bfSize = *length;
+  bf->bfReserved1 = 0;
+  bf->bfReserved2 = 0;
+  bf->bfOffBits = sizeof (BITMAPFILEHEADER) + get_dib_pixels_offset (bi);
+
+  memcpy (data + sizeof (BITMAPFILEHEADER), dib, dib_length);
+
+  return data;
+}
+
+/*
+ * Copies rows of 24 and 32 bits DIBs directly to a pixbuf. Returns NULL
+ * for other DIBs, those have to go through a BMP loader.
+ */
+static GdkPixbuf *
+convert_dib_to_pixbuf (const guchar *dib,
+                       gsize         dib_length)
+{
+  const BITMAPINFOHEADER   *bi = (const BITMAPINFOHEADER *) dib;
+  const FrdpBitmapV5Header *v5 = (const FrdpBitmapV5Header *) dib;
+  const guchar             *src;
+  GdkPixbuf                *pixbuf;
+  gboolean                  has_alpha = FALSE, top_down;
+  guchar                   *pixels, *dst;
+  gsize                     offset, src_stride;
+  gint                      width, height, rowstride, bytes_per_pixel, x, y;
+
+  if (dib_length < sizeof (BITMAPINFOHEADER) || bi->biWidth <= 0 || bi->biHeight == 0)
+    return NULL;
+
+  if (bi->biBitCount != 24 && bi->biBitCount != 32)
+    return NULL;
+
+  if (dib_length < bi->biSize)
+    return NULL;
+
+  if (bi->biCompression == FRDP_BI_BITFIELDS) {
+    /* Only the usual BGRA layout is supported, the masks follow BITMAPINFOHEADER directly. */
+    if (bi->biBitCount != 32 || dib_length < G_STRUCT_OFFSET (FrdpBitmapV5Header, bV5AlphaMask))
+      return NULL;
+    if (v5->bV5RedMask != 0x00FF0000 || v5->bV5GreenMask != 0x0000FF00 || v5->bV5BlueMask != 0x000000FF)
+      return NULL;
+    has_alpha = bi->biSize >= G_STRUCT_OFFSET (FrdpBitmapV5Header, bV5CSType) && v5->bV5AlphaMask == 0xFF000000;
+  } else if (bi->biCompression != FRDP_BI_RGB) {
+    return NULL;
+  }
+
+  width = bi->biWidth;
+  height = ABS (bi->biHeight);
+  top_down = bi->biHeight < 0;
+  bytes_per_pixel = bi->biBitCount / 8;
+  src_stride = ((gsize) width * bi->biBitCount + 31) / 32 * 4;
+  offset = get_dib_pixels_offset (bi);
+
+  if (offset > dib_length || (dib_length - offset) / src_stride < (gsize) height)
+    return NULL;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8, width, height);
+  if (pixbuf == NULL)
+    return NULL;
+
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y = 0; y < height; y++) {
+    src = dib + offset + (top_down ? y : height - 1 - y) * src_stride;
+    dst = pixels + y * rowstride;
+
+    for (x = 0; x < width; x++) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      if (has_alpha) {
+        dst[3] = src[3];
+        dst += 4;
+      } else {
+        dst += 3;
+      }
+      src += bytes_per_pixel;
+    }
+  }
+
+  return pixbuf;
+}
+
+/*
+ * Creates bottom-up 32 bits CF_DIB or CF_DIBV5 data from the pixbuf. Alpha
+ * is kept in CF_DIBV5 only, CF_DIB readers mostly ignore the fourth byte.
+ */
+static guchar *
+convert_pixbuf_to_dib (GdkPixbuf *pixbuf,
+                       gboolean   v5,
+                       gsize     *length)
+{
+  FrdpBitmapV5Header *header;
+  const guchar       *pixels, *src;
+  gboolean            has_alpha;
+  guchar             *data, *dst;
+  gsize               header_size, dst_stride;
+  gint                width, height, rowstride, n_channels, x, y;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  has_alpha = gdk_pixbuf_get_has_alpha (pixbuf);
+  pixels = gdk_pixbuf_read_pixels (pixbuf);
+
+  if (gdk_pixbuf_get_bits_per_sample (pixbuf) != 8 || n_channels < 3)
+    return NULL;
+
+  header_size = v5 ? sizeof (FrdpBitmapV5Header) : sizeof (BITMAPINFOHEADER);
+  dst_stride = (gsize) width * 4;
+  *length = header_size + dst_stride * height;
+  data = g_malloc0 (*length);
+
+  header = (FrdpBitmapV5Header *) data;
+  header->bV5Size = header_size;
+  header->bV5Width = width;
+  header->bV5Height = height;
+  header->bV5Planes = 1;
+  header->bV5BitCount = 32;
+  header->bV5SizeImage = dst_stride * height;
+  if (v5) {
+    header->bV5Compression = FRDP_BI_BITFIELDS;
+    header->bV5RedMask = 0x00FF0000;
+    header->bV5GreenMask = 0x0000FF00;
+    header->bV5BlueMask = 0x000000FF;
+    header->bV5AlphaMask = has_alpha ? 0xFF000000 : 0;
+    header->bV5CSType = FRDP_LCS_SRGB;
+    header->bV5Intent = FRDP_LCS_GM_IMAGES;
+  } else {
+    header->bV5Compression = FRDP_BI_RGB;
+  }
+
+  for (y = 0; y < height; y++) {
+    src = pixels + (height - 1 - y) * rowstride;
+    dst = data + header_size + y * dst_stride;
+
+    for (x = 0; x < width; x++) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      dst[3] = has_alpha ? src[3] : 0xFF;
+      src += n_channels;
+      dst += 4;
+    }
+  }
+
+  return data;
+}
+
+static void
+remote_cache_entry_free (FrdpClipboardCacheEntry *entry)
+{
+  g_bytes_unref (entry->data);
+  g_free (entry);
+}
+
+static void
+remote_cache_clear (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpClipboardCacheEntry     *entry;
+
+  while ((entry = g_queue_pop_head (priv->remote_cache)) != NULL)
+    remote_cache_entry_free (entry);
+
+  priv->remote_cache_size = 0;
+}
+
+static GBytes *
+remote_cache_lookup (FrdpChannelClipboard *self,
+                     guint                 format_id)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpClipboardCacheEntry     *entry;
+  GList                       *iter;
+
+  for (iter = priv->remote_cache->head; iter != NULL; iter = iter->next) {
+    entry = iter->data;
+
+    if (entry->generation == priv->format_list_generation &&
+        entry->format_id == format_id) {
+      g_queue_unlink (priv->remote_cache, iter);
+      g_queue_push_head_link (priv->remote_cache, iter);
+
+      return g_bytes_ref (entry->data);
+    }
+  }
+
+  return NULL;
+}
+
+static void
+remote_cache_insert (FrdpChannelClipboard *self,
+                     guint                 format_id,
+                     GBytes               *data)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpClipboardCacheEntry     *entry;
+  gsize                        size = g_bytes_get_size (data);
+
+  if (size > FRDP_CLIPBOARD_CACHE_SIZE)
+    return;
+
+  while (priv->remote_cache_size + size > FRDP_CLIPBOARD_CACHE_SIZE &&
+         (entry = g_queue_pop_tail (priv->remote_cache)) != NULL) {
+    priv->remote_cache_size -= g_bytes_get_size (entry->data);
+    remote_cache_entry_free (entry);
   }
 
-  return TRUE;
+  entry = g_new (FrdpClipboardCacheEntry, 1);
+  entry->generation = priv->format_list_generation;
+  entry->format_id = format_id;
+  entry->data = g_bytes_ref (data);
+
+  g_queue_push_head (priv->remote_cache, entry);
+  priv->remote_cache_size += size;
 }
 
-static void
-frdp_clipboard_request_free (FrdpClipboardRequest *request)
+/*
+ * Returns data of the given format from the remote clipboard. Each format
+ * is transferred once per format list, repeated pastes are served from
+ * remote_cache. Returns NULL on failure and also if the channel has been
+ * finalized meanwhile.
+ */
+static GBytes *
+get_remote_data (FrdpChannelClipboard *self,
+                 guint                 format_id)
 {
-  guint i;
+  CLIPRDR_LOCK_CLIPBOARD_DATA  lock_clipboard_data = { 0 };
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpClipboardDuration       *duration = priv->duration;
+  FrdpClipboardRequest        *request;
+  GBytes                      *data;
+
+  data = remote_cache_lookup (self, format_id);
+  if (data != NULL)
+    return data;
+
+  /* Lock the data once per format list so that file contents stay available. */
+  if (priv->remote_clip_data_generation != priv->format_list_generation) {
+    lock_clipboard_data.COMMON(msgType) = CB_LOCK_CLIPDATA;
+    lock_clipboard_data.COMMON(msgFlags) = 0;
+    lock_clipboard_data.COMMON(dataLen) = 4;
+    g_mutex_lock (&priv->requests_mutex);
+    lock_clipboard_data.clipDataId = ++priv->remote_clip_data_id;
+    g_mutex_unlock (&priv->requests_mutex);
+    priv->cliprdr_client_context->ClientLockClipboardData (priv->cliprdr_client_context, &lock_clipboard_data);
+    priv->remote_clip_data_generation = priv->format_list_generation;
+  }
 
-  g_free (request->requested_ids);
-  for (i = 0; i < request->count; i++)
-    g_free (request->responses[i].data);
-  g_free (request->responses);
-  g_free (request);
-}
+  request = frdp_clipboard_request_send (self, &format_id, 1);
+  if (request == NULL)
+    return NULL;
 
-static guint
-send_client_format_list_response (FrdpChannelClipboard *self,
-                                  gboolean              status)
-{
-  CLIPRDR_FORMAT_LIST_RESPONSE  response = { 0 };
-  FrdpChannelClipboardPrivate  *priv = frdp_channel_clipboard_get_instance_private (self);
+  frdp_clipboard_transfer_start (self);
 
-  response.COMMON(msgType) = CB_FORMAT_LIST_RESPONSE;
-  response.COMMON(msgFlags) = status ? CB_RESPONSE_OK : CB_RESPONSE_FAIL;
-  response.COMMON(dataLen) = 0;
+  frdp_clipboard_request_wait (self, request);
 
-  return priv->cliprdr_client_context->ClientFormatListResponse (priv->cliprdr_client_context, &response);
+  if (g_atomic_int_get (&duration->finalized))
+    return NULL;
+
+  /* Late responses of removed requests are dropped in server_format_data_response() */
+  if (!frdp_clipboard_request_done (request)) {
+    g_warning ("Remote clipboard data %s", request->timed_out ? "did not arrive in time" : "are not available anymore");
+    g_hash_table_remove (priv->requests, GUINT_TO_POINTER (request->id));
+    return NULL;
+  }
+
+  /* The received buffer is handed over to the caller and the cache as it is */
+  data = request->responses[0].data;
+  request->responses[0].data = NULL;
+  if (data != NULL)
+    remote_cache_insert (self, format_id, data);
+
+  g_hash_table_remove (priv->requests, GUINT_TO_POINTER (request->id));
+
+  return data;
 }
 
+/* Has to be called with fuse_lock locked for writing */
 static void
-replace_ascii_character (gchar *text,
-                         gchar  old_character,
-                         gchar  new_character)
+clear_remote_files_infos (FrdpChannelClipboard *self)
 {
-  guint i;
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  GHashTableIter               iter;
+  gchar                       *name;
+  guint                        i;
 
-  for (i = 0; text[i] != '\0'; i++) {
-    if (text[i] == old_character)
-      text[i] = new_character;
+  if (priv->stale_names == NULL)
+    priv->stale_names = g_ptr_array_new_with_free_func (g_free);
+
+  if (priv->remote_files_roots_names != NULL) {
+    g_hash_table_iter_init (&iter, priv->remote_files_roots_names);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &name, NULL))
+      g_ptr_array_add (priv->stale_names, g_strdup (name));
   }
-}
 
-static WCHAR *
-convert_to_unicode (const gchar *text)
-{
-  WCHAR *result = NULL;
+  g_mutex_lock (&priv->requests_mutex);
+  g_hash_table_iter_init (&iter, priv->negative_roots_names);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &name, NULL)) {
+    g_ptr_array_add (priv->stale_names, name);
+    g_hash_table_iter_steal (&iter);
+  }
+  g_mutex_unlock (&priv->requests_mutex);
 
-  if (text != NULL) {
-#ifdef HAVE_FREERDP3
-    result = ConvertUtf8ToWCharAlloc (text, NULL);
-#else
-    ConvertToUnicode (CP_UTF8, 0, (LPCSTR) text, -1, &result, 0);
-#endif
+  if (priv->remote_files_infos != NULL) {
+    for (i = 0; i < priv->remote_files_count; i++) {
+      g_free (priv->remote_files_infos[i].uri);
+      g_free (priv->remote_files_infos[i].path);
+      g_free (priv->remote_files_infos[i].filename);
+      if (priv->remote_files_infos[i].children != NULL)
+        g_array_unref (priv->remote_files_infos[i].children);
+      if (priv->remote_files_infos[i].children_names != NULL)
+        g_hash_table_unref (priv->remote_files_infos[i].children_names);
+    }
+    g_clear_pointer (&priv->remote_files_infos, g_free);
   }
+  priv->remote_files_count = 0;
+  g_clear_pointer (&priv->remote_files_roots, g_array_unref);
+  g_clear_pointer (&priv->remote_files_roots_names, g_hash_table_unref);
 
-  return result;
+  clear_remote_sizes (self);
 }
 
-static gchar *
-convert_from_unicode (const WCHAR *text,
-                      gint         text_length)
+/* Tells the kernel to forget dropped remote files of the channel */
+static void
+invalidate_stale_names (FrdpChannelClipboard *self)
 {
-  gchar *result = NULL;
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  GPtrArray                   *names;
 
-  if (text != NULL) {
-#ifdef HAVE_FREERDP3
-    result = ConvertWCharNToUtf8Alloc (text, text_length, NULL);
-#else
-    ConvertFromUnicode (CP_UTF8, 0, text, text_length, &result, 0, NULL, NULL);
-#endif
-  }
+  g_rw_lock_writer_lock (&priv->fuse_lock);
+  names = priv->stale_names;
+  priv->stale_names = NULL;
+  g_rw_lock_writer_unlock (&priv->fuse_lock);
 
-  return result;
+  if (names == NULL)
+    return;
+
+  if (priv->fuse_mount != NULL)
+    fuse_mount_invalidate (priv->fuse_mount, priv->fuse_root_inode, names);
+
+  g_ptr_array_unref (names);
 }
 
-/* TODO: Rewrite this using async methods of GtkCLipboard once we move to Gtk4 */
+/* TODO: Rewrite this using async methods of GtkClipboard once we move to Gtk4 */
 static void
 _gtk_clipboard_get_func (GtkClipboard     *clipboard,
                          GtkSelectionData *selection_data,
                          guint             info,
                          gpointer          user_data)
 {
-  CLIPRDR_LOCK_CLIPBOARD_DATA  lock_clipboard_data = { 0 };
   FrdpChannelClipboard        *self = (FrdpChannelClipboard *) user_data;
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
-  FrdpClipboardRequest        *current_request;
+  FrdpClipboardDuration       *duration = priv->duration;
+  GdkPixbufLoader             *loader;
+  const guchar                *response_data;
+  GdkPixbuf                   *pixbuf = NULL;
+  GBytes                      *response;
   gchar                       *data = NULL;
-  gint                         length;
+  gsize                        response_length;
+
+  response = get_remote_data (self, info);
 
-  lock_clipboard_data.COMMON(msgType) = CB_LOCK_CLIPDATA;
-  lock_clipboard_data.COMMON(msgFlags) = 0;
-  lock_clipboard_data.COMMON(dataLen) = 4;
-  lock_clipboard_data.clipDataId = ++priv->remote_clip_data_id;
-  priv->cliprdr_client_context->ClientLockClipboardData (priv->cliprdr_client_context, &lock_clipboard_data);
+  if (g_atomic_int_get (&duration->finalized))
+    return;
 
-  current_request = frdp_clipboard_request_send (self, info);
-  if (current_request != NULL) {
+  if (response != NULL) {
+    response_data = g_bytes_get_data (response, &response_length);
 
-    while (!frdp_clipboard_request_done (current_request))
-      gtk_main_iteration ();
+    if (info == priv->remote_html_id) {
+      gsize start, end;
 
-    if (info == CF_UNICODETEXT) {
-      /* TODO - convert CR LF to CR */
-      data = convert_from_unicode ((WCHAR *) current_request->responses[0].data, current_request->responses[0].length / sizeof (WCHAR));
-      if (data != NULL) {
-        length = strlen (data);
+      if (parse_cf_html ((const gchar *) response_data, response_length, &start, &end))
         gtk_selection_data_set (selection_data,
-                                gdk_atom_intern ("UTF8_STRING", FALSE),
+                                gdk_atom_intern ("text/html", FALSE),
                                 8,
-                                (guchar *) data,
-                                length);
-      }
-    } else if (info == CF_DIB) {
-      /* This has been inspired by function transmute_cf_dib_to_image_bmp() from gtk */
-      BITMAPINFOHEADER *bi = (BITMAPINFOHEADER *) current_request->responses[0].data;
-      BITMAPFILEHEADER *bf;
-
-      length = current_request->responses[0].length + sizeof (BITMAPFILEHEADER);
-      data = g_malloc (length);
+                                response_data + start,
+                                end - start);
+    } else if (info == priv->remote_rtf_id) {
+      const guchar *nul;
 
-      bf = (BITMAPFILEHEADER *) data;
-      bf->bfType = 0x4d42; /* "BM" */
-      bf->bfSize = length;
-      bf->bfReserved1 = 0;
-      bf->bfReserved2 = 0;
-      bf->bfOffBits = (sizeof (BITMAPFILEHEADER) + bi->biSize/* + bi->biClrUsed * sizeof (RGBQUAD)*/);
-
-      memcpy (data + sizeof (BITMAPFILEHEADER),
-              current_request->responses[0].data,
-              current_request->responses[0].length);
+      /* RTF is 7-bit text, only the terminating NUL has to go */
+      nul = memchr (response_data, '\0', response_length);
+      gtk_selection_data_set (selection_data,
+                              gtk_selection_data_get_target (selection_data),
+                              8,
+                              response_data,
+                              nul != NULL ? (gsize) (nul - response_data) : response_length);
+    } else if (info == CF_UNICODETEXT) {
+      gsize text_length;
 
+      data = convert_text_from_unicode ((const gunichar2 *) response_data, response_length / sizeof (gunichar2), &text_length);
       gtk_selection_data_set (selection_data,
-                              gdk_atom_intern ("image/bmp", FALSE),
+                              gdk_atom_intern ("UTF8_STRING", FALSE),
                               8,
                               (guchar *) data,
-                              length);
-    } else if (info == priv->fgdw_id) {
-      for (guint j = 0; j < current_request->count; j++) {
-        if (current_request->requested_ids[j] == priv->fgdw_id) {
-          FILEDESCRIPTORW  *files = (FILEDESCRIPTORW *) (current_request->responses[j].data + 4);
-          GList            *iter, *uri_list = NULL;
-          gchar            *path, **uri_array, *tmps, *slash, *dir;
-          guint             i, count = current_request->responses[j].length / sizeof (FILEDESCRIPTORW);
-
-          g_mutex_lock (&priv->fuse_mutex);
-
-          priv->remote_files_count = count;
-          priv->remote_files_infos = g_new0 (FrdpRemoteFileInfo, priv->remote_files_count);
-
-          for (i = 0; i < count; i++) {
-            path = convert_from_unicode ((WCHAR *) files[i].cFileName, 260 / sizeof (WCHAR));
-
-            replace_ascii_character (path, '\\', '/');
-
-            priv->remote_files_infos[i].path = g_strdup (path);
-            priv->remote_files_infos[i].is_directory = (files[i].dwFlags & FD_ATTRIBUTES) && (files[i].dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
-            priv->remote_files_infos[i].is_readonly = (files[i].dwFlags & FD_ATTRIBUTES) && (files[i].dwFileAttributes & FILE_ATTRIBUTE_READONLY);
-            priv->remote_files_infos[i].inode = priv->current_inode++;
-            priv->remote_files_infos[i].uri = g_strdup_printf ("file://%s/%s%s", priv->fuse_directory, path, priv->remote_files_infos[i].is_directory ? "/" : "");
-            if (files[i].dwFlags & FD_FILESIZE) {
-              priv->remote_files_infos[i].size = ((guint64) files[i].nFileSizeHigh << 32) + files[i].nFileSizeLow;
-              priv->remote_files_infos[i].has_size = TRUE;
+                              text_length);
+    } else if (info == FRDP_CLIPBOARD_FORMAT_PNG || info == FRDP_CLIPBOARD_FORMAT_JPEG) {
+      /* The same encoding is used on both sides */
+      gtk_selection_data_set (selection_data,
+                              gdk_atom_intern (info == FRDP_CLIPBOARD_FORMAT_PNG ? "image/png" : "image/jpeg", FALSE),
+                              8,
+                              response_data,
+                              response_length);
+    } else if (info == CF_DIB || info == CF_DIBV5) {
+      gboolean loaded;
+      gsize    bmp_length;
+
+      if (gtk_selection_data_get_target (selection_data) == gdk_atom_intern ("image/png", FALSE)) {
+        pixbuf = convert_dib_to_pixbuf (response_data, response_length);
+        if (pixbuf == NULL) {
+          /* Palettes, compressed DIBs etc. */
+          data = (gchar *) convert_dib_to_bmp (response_data, response_length, &bmp_length);
+          if (data != NULL) {
+            loader = gdk_pixbuf_loader_new_with_type ("bmp", NULL);
+            if (loader != NULL) {
+              loaded = gdk_pixbuf_loader_write (loader, (guchar *) data, bmp_length, NULL);
+              loaded = gdk_pixbuf_loader_close (loader, NULL) && loaded;
+              if (loaded && gdk_pixbuf_loader_get_pixbuf (loader) != NULL)
+                pixbuf = g_object_ref (gdk_pixbuf_loader_get_pixbuf (loader));
+              g_object_unref (loader);
             }
-            priv->remote_files_infos[i].parent_index = -1;
-
-            g_free (path);
           }
+        }
 
-          for (i = 0; i < count; i++) {
-            slash = NULL;
+        if (pixbuf != NULL) {
+          gtk_selection_data_set_pixbuf (selection_data, pixbuf);
+          g_object_unref (pixbuf);
+        }
+      } else {
+        data = (gchar *) convert_dib_to_bmp (response_data, response_length, &bmp_length);
+        if (data != NULL)
+          gtk_selection_data_set (selection_data,
+                                  gdk_atom_intern ("image/bmp", FALSE),
+                                  8,
+                                  (guchar *) data,
+                                  bmp_length);
+      }
+    } else if (info == priv->fgdw_id && frdp_channel_clipboard_mount (self)) {
+      FILEDESCRIPTORW  *files = (FILEDESCRIPTORW *) (response_data + 4);
+      FrdpRemoteFileInfo *parent;
+      GHashTable       *paths;
+      GList            *iter, *uri_list = NULL;
+      gchar            *path, **uri_array, *slash;
+      gpointer          parent_index;
+      guint             i, count = response_length / sizeof (FILEDESCRIPTORW);
+
+      g_rw_lock_writer_lock (&priv->fuse_lock);
+
+      /* Files of this format list are already available, possibly being copied by somebody */
+      if (priv->remote_files_infos == NULL ||
+          priv->remote_files_generation != priv->format_list_generation) {
+        clear_remote_files_infos (self);
+
+        priv->remote_files_generation = priv->format_list_generation;
+        g_mutex_lock (&priv->requests_mutex);
+        priv->remote_files_clip_data_id = priv->remote_clip_data_id;
+        g_mutex_unlock (&priv->requests_mutex);
+        priv->remote_files_count = count;
+        priv->remote_files_infos = g_new0 (FrdpRemoteFileInfo, priv->remote_files_count);
+        priv->remote_files_inode_base = priv->current_inode;
+        paths = g_hash_table_new (g_str_hash, g_str_equal);
+
+        for (i = 0; i < count; i++) {
+          path = convert_from_unicode ((WCHAR *) files[i].cFileName, 260 / sizeof (WCHAR));
+
+          replace_ascii_character (path, '\\', '/');
+
+          priv->remote_files_infos[i].path = g_strdup (path);
+          priv->remote_files_infos[i].is_directory = (files[i].dwFlags & FD_ATTRIBUTES) && (files[i].dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+          priv->remote_files_infos[i].is_readonly = (files[i].dwFlags & FD_ATTRIBUTES) && (files[i].dwFileAttributes & FILE_ATTRIBUTE_READONLY);
+          priv->remote_files_infos[i].inode = priv->current_inode++;
+          priv->remote_files_infos[i].uri = g_strdup_printf ("file://%s/%s%s", priv->fuse_directory, path, priv->remote_files_infos[i].is_directory ? "/" : "");
+          if (files[i].dwFlags & FD_FILESIZE) {
+            priv->remote_files_infos[i].size = ((guint64) files[i].nFileSizeHigh << 32) + files[i].nFileSizeLow;
+            priv->remote_files_infos[i].has_size = TRUE;
+          }
+          priv->remote_files_infos[i].parent_index = -1;
 
-            tmps = g_strdup (priv->remote_files_infos[i].uri);
-            if (priv->remote_files_infos[i].is_directory) {
-              if (g_str_has_suffix (tmps, "/"))
-                tmps[strlen (tmps) - 1] = '\0';
-            }
-            slash = g_strrstr (tmps, "/");
+          slash = strrchr (path, '/');
+          priv->remote_files_infos[i].filename = g_strdup (slash != NULL ? slash + 1 : path);
 
-            dir = NULL;
-            if (slash != NULL) {
+          g_hash_table_insert (paths, priv->remote_files_infos[i].path, GSIZE_TO_POINTER (i));
 
-              if (strlen (slash) > 1) {
-                priv->remote_files_infos[i].filename = g_strdup (slash + 1);
-                slash[1] = '\0';
-                dir = g_strdup (tmps);
-              }
+          g_free (path);
+        }
 
-              if (dir != NULL) {
-                if (g_str_equal (dir, priv->fuse_directory)) {
-                } else {
-                  for (j = 0; j < count; j++) {
-                    if (g_str_equal (dir, priv->remote_files_infos[j].uri)) {
-                      gsize *child_index;
-                      priv->remote_files_infos[i].parent_index = j;
-
-                      child_index = g_new (gsize, 1);
-                      *child_index = i;
-                      priv->remote_files_infos[j].children = g_list_append (priv->remote_files_infos[j].children, child_index);
-                      priv->remote_files_infos[i].parent_index = j;
-                      break;
-                    }
-                  }
+        /* Parents are found by their paths, the list does not have to be ordered */
+        priv->remote_files_roots = g_array_new (FALSE, FALSE, sizeof (gsize));
+        priv->remote_files_roots_names = g_hash_table_new (g_str_hash, g_str_equal);
+
+        for (i = 0; i < count; i++) {
+          gsize child_index = i;
+
+          slash = strrchr (priv->remote_files_infos[i].path, '/');
+          if (slash != NULL) {
+            path = g_strndup (priv->remote_files_infos[i].path, slash - priv->remote_files_infos[i].path);
+            if (g_hash_table_lookup_extended (paths, path, NULL, &parent_index)) {
+              parent = &priv->remote_files_infos[GPOINTER_TO_SIZE (parent_index)];
+              if (parent->is_directory) {
+                if (parent->children == NULL) {
+                  parent->children = g_array_new (FALSE, FALSE, sizeof (gsize));
+                  parent->children_names = g_hash_table_new (g_str_hash, g_str_equal);
                 }
-                g_free (dir);
+                g_array_append_val (parent->children, child_index);
+                if (!g_hash_table_contains (parent->children_names, priv->remote_files_infos[i].filename))
+                  g_hash_table_insert (parent->children_names,
+                                       priv->remote_files_infos[i].filename,
+                                       GSIZE_TO_POINTER (child_index));
+                priv->remote_files_infos[i].parent_index = GPOINTER_TO_SIZE (parent_index);
               }
             }
-            g_free (tmps);
+            g_free (path);
           }
 
-          /* Set URIs for topmost items only, the rest will be pasted as part of those. */
-          for (i = 0; i < priv->remote_files_count; i++) {
-            if (priv->remote_files_infos[i].parent_index < 0) {
-              uri_list = g_list_prepend (uri_list, priv->remote_files_infos[i].uri);
-            }
+          if (priv->remote_files_infos[i].parent_index < 0) {
+            g_array_append_val (priv->remote_files_roots, child_index);
+            if (!g_hash_table_contains (priv->remote_files_roots_names, priv->remote_files_infos[i].filename))
+              g_hash_table_insert (priv->remote_files_roots_names,
+                                   priv->remote_files_infos[i].filename,
+                                   GSIZE_TO_POINTER (child_index));
           }
+        }
 
-          g_mutex_unlock (&priv->fuse_mutex);
-
-          uri_array = g_new0 (gchar *, g_list_length (uri_list) + 1);
-          for (iter = uri_list, i = 0; iter != NULL; iter = iter->next, i++)
-            uri_array[i] = iter->data;
-
-          gtk_selection_data_set_uris (selection_data, uri_array);
+        g_hash_table_unref (paths);
+      }
 
-          g_free (uri_array);
-          g_list_free (uri_list);
+      /* Set URIs for topmost items only, the rest will be pasted as part of those. */
+      for (i = 0; i < priv->remote_files_count; i++) {
+        if (priv->remote_files_infos[i].parent_index < 0) {
+          uri_list = g_list_prepend (uri_list, g_strdup (priv->remote_files_infos[i].uri));
         }
       }
+
+      g_rw_lock_writer_unlock (&priv->fuse_lock);
+      fail_stale_size_waiters (self);
+      invalidate_stale_names (self);
+
+      uri_array = g_new0 (gchar *, g_list_length (uri_list) + 1);
+      for (iter = uri_list, i = 0; iter != NULL; iter = iter->next, i++)
+        uri_array[i] = iter->data;
+
+      gtk_selection_data_set_uris (selection_data, uri_array);
+
+      g_strfreev (uri_array);
+      g_list_free (uri_list);
     }
 
-    priv->requests = g_list_remove (priv->requests, current_request);
-    frdp_clipboard_request_free (current_request);
+    g_free (data);
+    g_bytes_unref (response);
   }
 }
 
@@ -1161,28 +3800,24 @@ _gtk_clipboard_clear_func (GtkClipboard *clipboard,
   CLIPRDR_UNLOCK_CLIPBOARD_DATA  unlock_clipboard_data = { 0 };
   FrdpChannelClipboard          *self = (FrdpChannelClipboard *) user_data;
   FrdpChannelClipboardPrivate   *priv = frdp_channel_clipboard_get_instance_private (self);
-  guint                          i;
-
-  g_mutex_lock (&priv->fuse_mutex);
 
-  if (priv->remote_files_infos != NULL) {
-    for (i = 0; i < priv->remote_files_count; i++) {
-      g_free (priv->remote_files_infos[i].uri);
-      g_free (priv->remote_files_infos[i].path);
-      g_free (priv->remote_files_infos[i].filename);
-      g_list_free_full (priv->remote_files_infos[i].children, g_free);
-    }
-    g_clear_pointer (&priv->remote_files_infos, g_free);
-  }
-  priv->remote_files_count = 0;
+  frdp_clipboard_requests_cancel (self);
+  remote_cache_clear (self);
 
-  g_mutex_unlock (&priv->fuse_mutex);
+  g_rw_lock_writer_lock (&priv->fuse_lock);
+  clear_remote_files_infos (self);
+  g_rw_lock_writer_unlock (&priv->fuse_lock);
+  fail_stale_size_waiters (self);
+  fail_file_requests (self, 0, EIO);
+  remote_blocks_invalidate (self);
+  invalidate_stale_names (self);
 
   unlock_clipboard_data.COMMON(msgType) = CB_UNLOCK_CLIPDATA;
   unlock_clipboard_data.COMMON(msgFlags) = 0;
   unlock_clipboard_data.COMMON(dataLen) = 4;
   unlock_clipboard_data.clipDataId = priv->remote_clip_data_id;
-  priv->cliprdr_client_context->ClientUnlockClipboardData (priv->cliprdr_client_context, &unlock_clipboard_data);
+  if (priv->cliprdr_client_context != NULL)
+    priv->cliprdr_client_context->ClientUnlockClipboardData (priv->cliprdr_client_context, &unlock_clipboard_data);
 
   clear_local_files_infos (self);
 
@@ -1198,6 +3833,7 @@ server_format_list (CliprdrClientContext      *context,
   GtkTargetEntry              *entries;
   GtkTargetList               *list;
   gboolean                     contains_file_group_descriptor_w = FALSE;
+  gboolean                     has_dib = FALSE, has_dibv5 = FALSE, has_png = FALSE;
   GdkAtom                      atom;
   guint                        i;
   gint                         count = 0;
@@ -1206,12 +3842,37 @@ server_format_list (CliprdrClientContext      *context,
     self = (FrdpChannelClipboard *) context->custom;
     priv = frdp_channel_clipboard_get_instance_private (self);
 
+    frdp_clipboard_requests_cancel (self);
+
+    /* Data of previous format lists are not needed anymore */
+    priv->format_list_generation++;
+    remote_cache_clear (self);
+
+    /* Local content has to be announced again even if it does not change */
+    g_clear_pointer (&priv->announced_targets_checksum, g_free);
+    g_clear_pointer (&priv->announced_content_checksum, g_free);
+    g_hash_table_remove_all (priv->local_responses);
+
+    /* Drop pending requests for targets of the local content which is being replaced */
+    priv->targets_serial++;
+    if (priv->owner_change_timeout_id != 0) {
+      g_source_remove (priv->owner_change_timeout_id);
+      priv->owner_change_timeout_id = 0;
+    }
+
     list = gtk_target_list_new (NULL, 0);
 
+    /* Registered formats are only noted here, their data are converted once requested */
+    priv->remote_html_id = 0;
+    priv->remote_rtf_id = 0;
     for (i = 0; i < format_list->numFormats; i++) {
       if (g_strcmp0 (format_list->formats[i].formatName, "FileGroupDescriptorW") == 0) {
         contains_file_group_descriptor_w = TRUE;
         priv->fgdw_id = format_list->formats[i].formatId;
+      } else if (g_strcmp0 (format_list->formats[i].formatName, "HTML Format") == 0) {
+        priv->remote_html_id = format_list->formats[i].formatId;
+      } else if (g_strcmp0 (format_list->formats[i].formatName, "Rich Text Format") == 0) {
+        priv->remote_rtf_id = format_list->formats[i].formatId;
       }
     }
 
@@ -1219,21 +3880,45 @@ server_format_list (CliprdrClientContext      *context,
       atom = gdk_atom_intern ("text/uri-list", FALSE);
       gtk_target_list_add (list, atom, 0, priv->fgdw_id);
     } else {
-      atom = GDK_NONE;
       for (i = 0; i < format_list->numFormats; i++) {
+        if (format_list->formats[i].formatId == CF_DIB)
+          has_dib = TRUE;
+        else if (format_list->formats[i].formatId == CF_DIBV5)
+          has_dibv5 = TRUE;
+        else if (format_list->formats[i].formatId == FRDP_CLIPBOARD_FORMAT_PNG)
+          has_png = TRUE;
+      }
+
+      for (i = 0; i < format_list->numFormats; i++) {
+        atom = GDK_NONE;
         if (format_list->formats[i].formatId == CF_TEXT) {
           atom = gdk_atom_intern ("TEXT", FALSE);
         } else if (format_list->formats[i].formatId == CF_UNICODETEXT) {
           atom = gdk_atom_intern ("UTF8_STRING", FALSE);
-        } else if (format_list->formats[i].formatId == CF_DIB) {
+        } else if (format_list->formats[i].formatId == CF_DIB ||
+                   (format_list->formats[i].formatId == CF_DIBV5 && !has_dib)) {
           atom = gdk_atom_intern ("image/bmp", FALSE);
         } else if (format_list->formats[i].formatId == FRDP_CLIPBOARD_FORMAT_PNG) {
           atom = gdk_atom_intern ("image/png", FALSE);
+        } else if (format_list->formats[i].formatId == FRDP_CLIPBOARD_FORMAT_JPEG) {
+          atom = gdk_atom_intern ("image/jpeg", FALSE);
         }
 
         if (atom != GDK_NONE)
           gtk_target_list_add (list, atom, 0, format_list->formats[i].formatId);
       }
+
+      /* Most applications accept PNG only, it is converted from the DIB then (keeping alpha of CF_DIBV5) */
+      if (!has_png && (has_dib || has_dibv5))
+        gtk_target_list_add (list, gdk_atom_intern ("image/png", FALSE), 0, has_dibv5 ? CF_DIBV5 : CF_DIB);
+
+      if (priv->remote_html_id != 0)
+        gtk_target_list_add (list, gdk_atom_intern ("text/html", FALSE), 0, priv->remote_html_id);
+
+      if (priv->remote_rtf_id != 0) {
+        gtk_target_list_add (list, gdk_atom_intern ("text/rtf", FALSE), 0, priv->remote_rtf_id);
+        gtk_target_list_add (list, gdk_atom_intern ("application/rtf", FALSE), 0, priv->remote_rtf_id);
+      }
     }
 
     entries = gtk_target_table_new_from_list (list, &count);
@@ -1267,8 +3952,11 @@ monitor_ready (CliprdrClientContext        *context,
     if ((return_value = send_client_capabilities (clipboard)) != CHANNEL_RC_OK)
       return return_value;
 
+    /* Announce what is known now, the list is sent again once current targets arrive. */
     if ((return_value = send_client_format_list (clipboard)) != CHANNEL_RC_OK)
       return return_value;
+
+    clipboard_owner_change_cb (NULL, NULL, clipboard);
   }
 
   return return_value;
@@ -1380,27 +4068,59 @@ send_data_response (FrdpChannelClipboard *self,
   response.COMMON(dataLen) = (guint32) size;
   response.requestedFormatData = data;
 
+  if (data != NULL)
+    frdp_clipboard_transfer_add (self, size);
+
   return priv->cliprdr_client_context->ClientFormatDataResponse (priv->cliprdr_client_context, &response);
 }
 
+/*
+ * Keeps the response so that further requests for unchanged content do not
+ * need to encode it again. Takes ownership of data, NULL sends a failure.
+ */
+static guint
+send_local_data_response (FrdpChannelClipboard      *self,
+                          FrdpClipboardLocalRequest *content_request,
+                          GBytes                    *data)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  guint                        result;
+
+  if (data == NULL)
+    return send_data_response (self, NULL, 0);
+
+  if (content_request->serial == priv->local_generation)
+    g_hash_table_insert (priv->local_responses,
+                         GUINT_TO_POINTER (content_request->format_id),
+                         g_bytes_ref (data));
+
+  result = send_data_response (self, g_bytes_get_data (data, NULL), g_bytes_get_size (data));
+  g_bytes_unref (data);
+
+  return result;
+}
+
 static void
 clipboard_content_received (GtkClipboard     *clipboard,
                             GtkSelectionData *selection_data,
                             gpointer          user_data)
 {
-  FrdpClipboardDuration       *duration = (FrdpClipboardDuration *) user_data;
+  FrdpClipboardLocalRequest   *content_request = user_data;
+  FrdpClipboardDuration       *duration = content_request->duration;
   FrdpChannelClipboard        *self;
   FrdpChannelClipboardPrivate *priv;
-  GdkPixbuf                   *pixbuf;
+  const guchar                *bmp;
   GdkAtom                      data_type;
-  guchar                      *data, *text;
+  guchar                      *data;
   GError                      *error = NULL;
-  gsize                        text_length, buffer_size = 0;
+  gsize                        text_length;
   guint                        i;
   gint                         length;
 
-  if (g_atomic_int_get (&duration->finalized))
+  if (g_atomic_int_get (&duration->finalized)) {
+    g_free (content_request);
     return;
+  }
 
   self = (FrdpChannelClipboard *) duration->self;
   priv = frdp_channel_clipboard_get_instance_private (self);
@@ -1408,34 +4128,37 @@ clipboard_content_received (GtkClipboard     *clipboard,
   length = gtk_selection_data_get_length (selection_data);
   data_type = gtk_selection_data_get_data_type (selection_data);
 
-  if (length > 0) {
+  if (length > 0 && frdp_clipboard_exceeds_max_size (self, length)) {
+    send_data_response (self, NULL, 0);
+  } else if (length > 0) {
     if (data_type == gdk_atom_intern ("UTF8_STRING", FALSE)) {
-      text = gtk_selection_data_get_text (selection_data);
-      text_length = strlen ((gchar *) text);
-
-      data = (guchar *) convert_to_unicode ((gchar *) text);
-      if (data != NULL) {
-        send_data_response (self, data, (text_length + 1) * sizeof (WCHAR));
-        g_free (data);
-      }
-
-      g_free (text);
-    } else if (data_type == gdk_atom_intern ("image/png", FALSE)) {
-      pixbuf = gtk_selection_data_get_pixbuf (selection_data);
-      if (gdk_pixbuf_save_to_buffer (pixbuf, (gchar **) &data, &buffer_size, "png", NULL, NULL))
-        send_data_response (self, data, buffer_size);
-      g_object_unref (pixbuf);
-    } else if (data_type == gdk_atom_intern ("image/jpeg", FALSE)) {
-      pixbuf = gtk_selection_data_get_pixbuf (selection_data);
-      if (gdk_pixbuf_save_to_buffer (pixbuf, (gchar **) &data, &buffer_size, "jpeg", NULL, NULL))
-        send_data_response (self, data, buffer_size);
-      g_object_unref (pixbuf);
+      /* UTF8_STRING is UTF-8 already, it is converted directly from the selection */
+      data = (guchar *) convert_text_to_unicode ((const gchar *) gtk_selection_data_get_data (selection_data),
+                                                 length,
+                                                 &text_length);
+      send_local_data_response (self, content_request, g_bytes_new_take (data, text_length));
+    } else if (data_type == gdk_atom_intern ("text/html", FALSE)) {
+      gsize html_length;
+
+      data = (guchar *) convert_html_to_cf_html (gtk_selection_data_get_data (selection_data), length, &html_length);
+      send_local_data_response (self, content_request,
+                                data != NULL ? g_bytes_new_take (data, html_length) : NULL);
+    } else if (data_type == gdk_atom_intern ("text/rtf", FALSE) ||
+               data_type == gdk_atom_intern ("application/rtf", FALSE) ||
+               data_type == gdk_atom_intern ("text/richtext", FALSE) ||
+               data_type == gdk_atom_intern ("image/png", FALSE) ||
+               data_type == gdk_atom_intern ("image/jpeg", FALSE)) {
+      /* The same encoding is used on both sides */
+      send_local_data_response (self, content_request,
+                                g_bytes_new (gtk_selection_data_get_data (selection_data), length));
     } else if (data_type == gdk_atom_intern ("image/bmp", FALSE)) {
-      pixbuf = gtk_selection_data_get_pixbuf (selection_data);
-      if (gdk_pixbuf_save_to_buffer (pixbuf, (gchar **) &data, &buffer_size, "bmp", NULL, NULL)) {
-        send_data_response (self, data + sizeof (BITMAPFILEHEADER), buffer_size - sizeof (BITMAPFILEHEADER));
-      }
-      g_object_unref (pixbuf);
+      /* CF_DIB is a BMP file without BITMAPFILEHEADER */
+      bmp = gtk_selection_data_get_data (selection_data);
+      if (length > (gint) sizeof (BITMAPFILEHEADER) && bmp[0] == 'B' && bmp[1] == 'M')
+        send_local_data_response (self, content_request,
+                                  g_bytes_new (bmp + sizeof (BITMAPFILEHEADER), length - sizeof (BITMAPFILEHEADER)));
+      else
+        send_data_response (self, NULL, 0);
     } else if (data_type == gdk_atom_intern ("text/uri-list", FALSE)) {
       FrdpLocalFileInfo *frdp_file_info;
       FILEDESCRIPTORW   *descriptors;
@@ -1505,11 +4228,69 @@ clipboard_content_received (GtkClipboard     *clipboard,
         priv->awaiting_data_request = FALSE;
       }
 
-      send_data_response (self, data, priv->local_files_count * sizeof (FILEDESCRIPTORW) + 4);
+      send_local_data_response (self, content_request,
+                                g_bytes_new_take (data, priv->local_files_count * sizeof (FILEDESCRIPTORW) + 4));
     }
   } else {
     g_warning ("No data received from local clipboard for sending to remote side!");
+    send_data_response (self, NULL, 0);
+  }
+
+  g_free (content_request);
+}
+
+static void
+clipboard_image_received (GtkClipboard *clipboard,
+                          GdkPixbuf    *pixbuf,
+                          gpointer      user_data)
+{
+  FrdpClipboardLocalRequest *content_request = user_data;
+  FrdpChannelClipboard      *self;
+  guchar                    *data = NULL;
+  gsize                      length = 0;
+
+  if (g_atomic_int_get (&content_request->duration->finalized)) {
+    g_free (content_request);
+    return;
   }
+
+  self = (FrdpChannelClipboard *) content_request->duration->self;
+
+  /* The DIB is as large as the pixbuf with 4 bytes per pixel */
+  if (pixbuf != NULL &&
+      frdp_clipboard_exceeds_max_size (self, (gsize) gdk_pixbuf_get_width (pixbuf) * gdk_pixbuf_get_height (pixbuf) * 4)) {
+    send_data_response (self, NULL, 0);
+    g_free (content_request);
+    return;
+  }
+
+  if (pixbuf != NULL)
+    data = convert_pixbuf_to_dib (pixbuf, content_request->format_id == CF_DIBV5, &length);
+
+  if (data != NULL) {
+    send_local_data_response (self, content_request, g_bytes_new_take (data, length));
+  } else {
+    g_warning ("No image received from local clipboard for sending to remote side!");
+    send_data_response (self, NULL, 0);
+  }
+
+  g_free (content_request);
+}
+
+static gboolean
+local_targets_include (FrdpChannelClipboard *self,
+                       const gchar          *target_name)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  GdkAtom                      target = gdk_atom_intern (target_name, FALSE);
+  gint                         i;
+
+  for (i = 0; i < priv->local_targets_count; i++) {
+    if (priv->local_targets[i] == target)
+      return TRUE;
+  }
+
+  return FALSE;
 }
 
 static guint
@@ -1518,48 +4299,89 @@ server_format_data_request (CliprdrClientContext              *context,
 {
   FrdpChannelClipboard        *self = (FrdpChannelClipboard *) context->custom;
   FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpClipboardLocalRequest   *content_request;
+  GdkAtom                      target = GDK_NONE;
+  GBytes                      *response;
+  gboolean                     image = FALSE;
   guint                        format;
 
   format = format_data_request->requestedFormatId;
 
-  /* TODO: Add more formats (e.g. CF_DIBV5, CF_TEXT, CF_OEMTEXT) */
+  /* TODO: Add more formats (e.g. CF_TEXT, CF_OEMTEXT) */
   switch (format) {
     case CF_UNICODETEXT:
-      gtk_clipboard_request_contents (priv->gtk_clipboard,
-                                      gdk_atom_intern ("UTF8_STRING", FALSE),
-                                      clipboard_content_received,
-                                      priv->duration);
+      target = gdk_atom_intern ("UTF8_STRING", FALSE);
       break;
     case FRDP_CLIPBOARD_FORMAT_PNG:
-      gtk_clipboard_request_contents (priv->gtk_clipboard,
-                                      gdk_atom_intern ("image/png", FALSE),
-                                      clipboard_content_received,
-                                      priv->duration);
+      target = gdk_atom_intern ("image/png", FALSE);
       break;
     case FRDP_CLIPBOARD_FORMAT_JPEG:
-      gtk_clipboard_request_contents (priv->gtk_clipboard,
-                                      gdk_atom_intern ("image/jpeg", FALSE),
-                                      clipboard_content_received,
-                                      priv->duration);
+      target = gdk_atom_intern ("image/jpeg", FALSE);
+      break;
+    case FRDP_CLIPBOARD_FORMAT_HTML:
+      target = gdk_atom_intern ("text/html", FALSE);
+      break;
+    case FRDP_CLIPBOARD_FORMAT_RTF:
+      if (local_targets_include (self, "text/rtf"))
+        target = gdk_atom_intern ("text/rtf", FALSE);
+      else if (local_targets_include (self, "application/rtf"))
+        target = gdk_atom_intern ("application/rtf", FALSE);
+      else
+        target = gdk_atom_intern ("text/richtext", FALSE);
       break;
     case CF_DIB:
-      gtk_clipboard_request_contents (priv->gtk_clipboard,
-                                      gdk_atom_intern ("image/bmp", FALSE),
-                                      clipboard_content_received,
-                                      priv->duration);
+      /* BMP data are passed through, other images are converted */
+      if (local_targets_include (self, "image/bmp"))
+        target = gdk_atom_intern ("image/bmp", FALSE);
+      else
+        image = TRUE;
+      break;
+    case CF_DIBV5:
+      image = TRUE;
       break;
     default:
       if (format == priv->fgdw_id) {
-        gtk_clipboard_request_contents (priv->gtk_clipboard,
-                                        gdk_atom_intern ("text/uri-list", FALSE),
-                                        clipboard_content_received,
-                                        priv->duration);
+        target = gdk_atom_intern ("text/uri-list", FALSE);
         break;
       } else {
         g_warning ("Requesting clipboard data of type %d not implemented.", format);
       }
   }
 
+  if (target == GDK_NONE && !image)
+    return send_data_response (self, NULL, 0);
+
+  /* Local content has not changed since this format was sent last time */
+  response = g_hash_table_lookup (priv->local_responses, GUINT_TO_POINTER (format));
+  if (response != NULL) {
+    if (format == priv->fgdw_id && priv->awaiting_data_request && priv->pending_lock) {
+      lock_current_local_files (self, priv->pending_lock_id);
+
+      priv->awaiting_data_request = FALSE;
+    }
+
+    return send_data_response (self,
+                               g_bytes_get_data (response, NULL),
+                               g_bytes_get_size (response));
+  }
+
+  frdp_clipboard_transfer_start (self);
+
+  content_request = g_new0 (FrdpClipboardLocalRequest, 1);
+  content_request->duration = priv->duration;
+  content_request->serial = priv->local_generation;
+  content_request->format_id = format;
+
+  if (image)
+    gtk_clipboard_request_image (priv->gtk_clipboard,
+                                 clipboard_image_received,
+                                 content_request);
+  else
+    gtk_clipboard_request_contents (priv->gtk_clipboard,
+                                    target,
+                                    clipboard_content_received,
+                                    content_request);
+
   return CHANNEL_RC_OK;
 }
 
@@ -1567,39 +4389,42 @@ static guint
 server_format_data_response (CliprdrClientContext               *context,
                              const CLIPRDR_FORMAT_DATA_RESPONSE *response)
 {
-  FrdpChannelClipboard        *self;
-  FrdpChannelClipboardPrivate *priv;
-  FrdpClipboardRequest        *current_request;
-  guint                        j;
-  gint                         subrequest_index = -1;
+  FrdpClipboardPendingResponse *pending;
+  FrdpChannelClipboard         *self;
+  FrdpChannelClipboardPrivate  *priv;
+  FrdpClipboardResponseData    *response_data;
+  FrdpClipboardRequest         *current_request;
 
   if (context != NULL) {
     self = (FrdpChannelClipboard *) context->custom;
     priv = frdp_channel_clipboard_get_instance_private (self);
 
     if (response->COMMON(msgType) == CB_FORMAT_DATA_RESPONSE) {
-      if (priv->requests != NULL) {
-        current_request = priv->requests->data;
-        for (j = 0; j < current_request->count; j++) {
-          if (!current_request->responses[j].handled) {
-            subrequest_index = j;
-            break;
-          }
-        }
+      pending = g_queue_pop_head (priv->pending_responses);
+      if (pending == NULL) {
+        g_warning ("Response without request!");
+        return CHANNEL_RC_OK;
+      }
 
-        if (subrequest_index >= 0 && subrequest_index < current_request->count) {
-          current_request->responses[subrequest_index].handled = TRUE;
-          if (response->COMMON(msgFlags) & CB_RESPONSE_OK) {
-            current_request->responses[subrequest_index].length = response->COMMON(dataLen);
-            current_request->responses[subrequest_index].data = g_new (guchar, response->COMMON(dataLen));
-            memcpy (current_request->responses[subrequest_index].data, response->requestedFormatData, response->COMMON(dataLen));
-          } else {
-            g_warning ("Clipboard data request failed!");
-          }
+      /* The request is gone if it has been cancelled or has timed out */
+      current_request = g_hash_table_lookup (priv->requests, GUINT_TO_POINTER (pending->request_id));
+      if (current_request != NULL) {
+        response_data = &current_request->responses[pending->index];
+        response_data->handled = TRUE;
+        if (response->COMMON(msgFlags) & CB_RESPONSE_OK) {
+          /* FreeRDP releases its buffer after this callback, this is the only copy of the data */
+          if (!frdp_clipboard_exceeds_max_size (self, response->COMMON(dataLen)))
+            response_data->data = g_bytes_new (response->requestedFormatData, response->COMMON(dataLen));
+          frdp_clipboard_transfer_add (self, response->COMMON(dataLen));
+        } else {
+          g_warning ("Clipboard data request failed!");
         }
-      } else {
-        g_warning ("Response without request!");
+
+        if (frdp_clipboard_request_done (current_request) && current_request->loop != NULL)
+          g_main_loop_quit (current_request->loop);
       }
+
+      g_free (pending);
     }
   }
 
@@ -1702,67 +4527,144 @@ server_file_contents_request (CliprdrClientContext                *context,
 
   g_mutex_unlock (&priv->lock_mutex);
 
+  if (response.COMMON(msgFlags) == CB_RESPONSE_OK && file_contents_request->dwFlags & FILECONTENTS_RANGE)
+    frdp_clipboard_transfer_add (self, response.cbRequested);
+
   return priv->cliprdr_client_context->ClientFileContentsResponse (priv->cliprdr_client_context, &response);
 }
 
+static void
+remote_block_finished (FrdpChannelClipboard  *self,
+                       FrdpRemoteFileRequest *request,
+                       const BYTE            *requested_data,
+                       UINT32                 requested_length,
+                       gint                   error)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+  FrdpRemoteFileBlock          key = { 0 };
+  FrdpRemoteFileBlock         *block;
+  FrdpRemoteFileRead          *read;
+  GBytes                      *data = NULL;
+  GList                       *waiters = NULL, *complete = NULL, *iter;
+
+  if (error == 0)
+    data = g_bytes_new (requested_data, requested_length);
+
+  key.clip_data_id = request->clip_data_id;
+  key.index = request->index;
+  key.number = request->offset / FRDP_FUSE_BLOCK_SIZE;
+
+  g_mutex_lock (&priv->blocks_mutex);
+  /* The block might have been dropped or fetched again in the meantime */
+  block = g_hash_table_lookup (priv->remote_blocks, &key);
+  if (block != NULL && block->data == NULL) {
+    waiters = block->waiters;
+    block->waiters = NULL;
+
+    /* A failed block is requested again by the next read */
+    if (data != NULL)
+      remote_block_store (self, block, data);
+    else
+      g_hash_table_remove (priv->remote_blocks, block);
+
+    for (iter = waiters; iter != NULL; iter = iter->next) {
+      read = iter->data;
+      if (data != NULL)
+        read->blocks[key.number - read->first] = g_bytes_ref (data);
+      else
+        read->error = error;
+      if (--read->pending == 0)
+        complete = g_list_prepend (complete, read);
+    }
+  }
+  g_mutex_unlock (&priv->blocks_mutex);
+
+  g_list_free_full (complete, (GDestroyNotify) reply_read);
+  g_list_free (waiters);
+  if (data != NULL)
+    g_bytes_unref (data);
+}
+
+static void
+fail_file_request (FrdpChannelClipboard  *self,
+                   FrdpRemoteFileRequest *request,
+                   gint                   error)
+{
+  switch (request->op) {
+    case FUSE_SIZE_OP:
+      remote_size_finished (self, request, 0, error);
+      break;
+
+    case FUSE_READ_OP:
+      fuse_reply_err (request->request, error);
+      break;
+
+    case FUSE_BLOCK_OP:
+      remote_block_finished (self, request, NULL, 0, error);
+      break;
+
+    default:
+      g_assert_not_reached ();
+  }
+
+  g_free (request);
+}
+
 static guint
 server_file_contents_response (CliprdrClientContext                 *context,
                                const CLIPRDR_FILE_CONTENTS_RESPONSE *file_contents_response)
 {
   FrdpChannelClipboard        *self;
   FrdpChannelClipboardPrivate *priv;
-  struct fuse_entry_param      entry = {0};
   FrdpRemoteFileRequest       *request;
-  struct stat                  attr = {0};
 
-  if (context != NULL && file_contents_response->COMMON(msgFlags) & CB_RESPONSE_OK) {
+  if (context != NULL) {
     self = (FrdpChannelClipboard *) context->custom;
     priv = frdp_channel_clipboard_get_instance_private (self);
 
+    g_mutex_lock (&priv->requests_mutex);
     request = g_hash_table_lookup (priv->remote_files_requests,
                                    GUINT_TO_POINTER (file_contents_response->streamId));
-    if (request != NULL) {
-      g_mutex_lock (&priv->fuse_mutex);
-      switch (request->op) {
-        case FUSE_LOOKUP_OP:
-          priv->remote_files_infos[request->index].size = *((guint64 *) file_contents_response->requestedData);
-          priv->remote_files_infos[request->index].has_size = TRUE;
-
-          entry.ino = priv->remote_files_infos[request->index].inode;
-          get_file_attributes (priv->remote_files_infos[request->index], &entry.attr);
-          entry.attr_timeout = 1.0;
-          entry.entry_timeout = 1.0;
-
-          fuse_reply_entry (request->request, &entry);
-          break;
+    if (request != NULL)
+      g_hash_table_steal (priv->remote_files_requests,
+                          GUINT_TO_POINTER (file_contents_response->streamId));
+    g_mutex_unlock (&priv->requests_mutex);
 
-        case FUSE_GETATTR_OP:
-          priv->remote_files_infos[request->index].size = *((guint64 *) file_contents_response->requestedData);
-          priv->remote_files_infos[request->index].has_size = TRUE;
+    if (request == NULL)
+      return CHANNEL_RC_OK;
 
-          get_file_attributes (priv->remote_files_infos[request->index], &attr);
-          fuse_reply_attr (request->request, &attr, 1);
-          break;
+    if (!(file_contents_response->COMMON(msgFlags) & CB_RESPONSE_OK) ||
+        (request->op == FUSE_SIZE_OP && file_contents_response->cbRequested < sizeof (guint64))) {
+      g_warning ("Server file response has failed!");
+      fail_file_request (self, request, EIO);
+      return CHANNEL_RC_OK;
+    }
 
-        case FUSE_READ_OP:
-          fuse_reply_buf (request->request,
-                          (const char *) file_contents_response->requestedData,
-                          file_contents_response->cbRequested);
-          break;
+    switch (request->op) {
+      case FUSE_SIZE_OP:
+        remote_size_finished (self, request, *((guint64 *) file_contents_response->requestedData), 0);
+        break;
 
-        default:
-          g_assert_not_reached ();
-      }
+      case FUSE_READ_OP:
+        fuse_reply_buf (request->request,
+                        (const char *) file_contents_response->requestedData,
+                        file_contents_response->cbRequested);
+        frdp_clipboard_transfer_add (self, file_contents_response->cbRequested);
+        break;
 
-      g_hash_table_remove (priv->remote_files_requests,
-                           GUINT_TO_POINTER (file_contents_response->streamId));
-      g_free (request);
-      g_mutex_unlock (&priv->fuse_mutex);
-    }
-  } else {
-    if (file_contents_response->COMMON(msgFlags) & CB_RESPONSE_FAIL) {
-      g_warning ("Server file response has failed!");
+      case FUSE_BLOCK_OP:
+        remote_block_finished (self, request,
+                               file_contents_response->requestedData,
+                               file_contents_response->cbRequested,
+                               0);
+        frdp_clipboard_transfer_add (self, file_contents_response->cbRequested);
+        break;
+
+      default:
+        g_assert_not_reached ();
     }
+
+    g_free (request);
   }
 
   return CHANNEL_RC_OK;
@@ -1874,3 +4776,21 @@ frdp_channel_clipboard_set_client_context (FrdpChannelClipboard *self,
   context->ServerLockClipboardData = server_lock_clipboard_data;
   context->ServerUnlockClipboardData = server_unlock_clipboard_data;
 }
+
+/*
+ * Leaves the FUSE mount and waits for the workers serving the channel, so that
+ * the client context, which does not outlive the session, is not used anymore.
+ */
+void
+frdp_channel_clipboard_detach (FrdpChannelClipboard *self)
+{
+  FrdpChannelClipboardPrivate *priv = frdp_channel_clipboard_get_instance_private (self);
+
+  if (priv->detached)
+    return;
+
+  priv->detached = TRUE;
+  frdp_channel_clipboard_unmount (self);
+
+  priv->cliprdr_client_context = NULL;
+}
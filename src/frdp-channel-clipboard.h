@@ -24,6 +24,12 @@ G_BEGIN_DECLS
 
 #define FRDP_TYPE_CHANNEL_CLIPBOARD (frdp_channel_clipboard_get_type())
 
+/* Milliseconds to wait for clipboard data from the server */
+#define FRDP_CLIPBOARD_DEFAULT_TIMEOUT 10000
+
+/* Bytes of clipboard data transferred at most in one piece */
+#define FRDP_CLIPBOARD_DEFAULT_MAX_SIZE (128 * 1024 * 1024)
+
 G_DECLARE_FINAL_TYPE (FrdpChannelClipboard, frdp_channel_clipboard, FRDP, CHANNEL_CLIPBOARD, GObject)
 
 typedef struct _FrdpChannelClipboard FrdpChannelClipboard;
@@ -38,4 +44,6 @@ struct _FrdpChannelClipboardClass
   FrdpChannelClass parent_class;
 };
 
+void     frdp_channel_clipboard_detach (FrdpChannelClipboard *self);
+
 G_END_DECLS
@@ -0,0 +1,193 @@
+/* frdp-channel-touch.c
+ *
+ * Copyright (C) 2026 The gtk-frdp authors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "frdp-channel-touch.h"
+
+#include <freerdp/freerdp.h>
+#include <freerdp/client/rdpei.h>
+
+typedef struct
+{
+  gint     external_id;
+  gint     x;
+  gint     y;
+
+  gboolean started;  /* TouchBegin() has been sent already */
+  gboolean dirty;    /* Position changed since the last frame */
+  gboolean ended;
+} FrdpTouchContact;
+
+typedef struct
+{
+  RdpeiClientContext *rdpei_client_context;
+
+  GHashTable         *contacts;  /* GdkEventSequence * -> FrdpTouchContact * */
+  gint                next_external_id;
+} FrdpChannelTouchPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (FrdpChannelTouch, frdp_channel_touch, FRDP_TYPE_CHANNEL)
+
+enum
+{
+  PROP_0 = 0,
+  PROP_RDPEI_CLIENT_CONTEXT,
+  LAST_PROP
+};
+
+static void
+frdp_channel_touch_get_property (GObject    *object,
+                                 guint       property_id,
+                                 GValue     *value,
+                                 GParamSpec *pspec)
+{
+  FrdpChannelTouch        *self = FRDP_CHANNEL_TOUCH (object);
+  FrdpChannelTouchPrivate *priv = frdp_channel_touch_get_instance_private (self);
+
+  switch (property_id)
+    {
+      case PROP_RDPEI_CLIENT_CONTEXT:
+        g_value_set_pointer (value, priv->rdpei_client_context);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+frdp_channel_touch_set_property (GObject      *object,
+                                 guint         property_id,
+                                 const GValue *value,
+                                 GParamSpec   *pspec)
+{
+  FrdpChannelTouch        *self = FRDP_CHANNEL_TOUCH (object);
+  FrdpChannelTouchPrivate *priv = frdp_channel_touch_get_instance_private (self);
+
+  switch (property_id)
+    {
+      case PROP_RDPEI_CLIENT_CONTEXT:
+        priv->rdpei_client_context = g_value_get_pointer (value);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+frdp_channel_touch_finalize (GObject *object)
+{
+  FrdpChannelTouch        *self = FRDP_CHANNEL_TOUCH (object);
+  FrdpChannelTouchPrivate *priv = frdp_channel_touch_get_instance_private (self);
+
+  g_hash_table_unref (priv->contacts);
+
+  G_OBJECT_CLASS (frdp_channel_touch_parent_class)->finalize (object);
+}
+
+static void
+frdp_channel_touch_class_init (FrdpChannelTouchClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->get_property = frdp_channel_touch_get_property;
+  gobject_class->set_property = frdp_channel_touch_set_property;
+  gobject_class->finalize = frdp_channel_touch_finalize;
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_RDPEI_CLIENT_CONTEXT,
+                                   g_param_spec_pointer ("rdpei-client-context",
+                                                         "rdpei-client-context",
+                                                         "Context for input extension client",
+                                                         G_PARAM_READWRITE));
+}
+
+static void
+frdp_channel_touch_init (FrdpChannelTouch *self)
+{
+  FrdpChannelTouchPrivate *priv = frdp_channel_touch_get_instance_private (self);
+
+  priv->contacts = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  priv->next_external_id = 1;
+}
+
+/*
+ * Records new state of the contact given by @sequence. Nothing is sent
+ * until frdp_channel_touch_flush() is called so that all contacts changed
+ * within one frame end up in the same touch frame.
+ */
+void
+frdp_channel_touch_update_contact (FrdpChannelTouch *self,
+                                   GdkEventSequence *sequence,
+                                   GdkEventType      type,
+                                   gint              x,
+                                   gint              y)
+{
+  FrdpChannelTouchPrivate *priv = frdp_channel_touch_get_instance_private (self);
+  FrdpTouchContact        *contact;
+
+  contact = g_hash_table_lookup (priv->contacts, sequence);
+
+  if (type == GDK_TOUCH_BEGIN && contact == NULL) {
+    contact = g_new0 (FrdpTouchContact, 1);
+    contact->external_id = priv->next_external_id++;
+    g_hash_table_insert (priv->contacts, sequence, contact);
+  }
+
+  if (contact == NULL)
+    return;
+
+  contact->x = x;
+  contact->y = y;
+  contact->dirty = TRUE;
+
+  if (type == GDK_TOUCH_END || type == GDK_TOUCH_CANCEL)
+    contact->ended = TRUE;
+}
+
+/*
+ * Sends all contacts changed since the last call.
+ */
+void
+frdp_channel_touch_flush (FrdpChannelTouch *self)
+{
+  FrdpChannelTouchPrivate *priv = frdp_channel_touch_get_instance_private (self);
+  RdpeiClientContext      *context = priv->rdpei_client_context;
+  FrdpTouchContact        *contact;
+  GHashTableIter           iter;
+  gint                     contact_id;
+
+  g_hash_table_iter_init (&iter, priv->contacts);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &contact)) {
+    if (contact->dirty && context != NULL) {
+      if (!contact->started) {
+        context->TouchBegin (context, contact->external_id, contact->x, contact->y, &contact_id);
+        contact->started = TRUE;
+      } else if (!contact->ended) {
+        context->TouchUpdate (context, contact->external_id, contact->x, contact->y, &contact_id);
+      }
+
+      if (contact->ended)
+        context->TouchEnd (context, contact->external_id, contact->x, contact->y, &contact_id);
+    }
+
+    contact->dirty = FALSE;
+    if (contact->ended || context == NULL)
+      g_hash_table_iter_remove (&iter);
+  }
+}
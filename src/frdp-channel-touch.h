@@ -0,0 +1,49 @@
+/* frdp-channel-touch.h
+ *
+ * Copyright (C) 2026 The gtk-frdp authors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "frdp-channel.h"
+
+G_BEGIN_DECLS
+
+#define FRDP_TYPE_CHANNEL_TOUCH (frdp_channel_touch_get_type())
+
+G_DECLARE_FINAL_TYPE (FrdpChannelTouch, frdp_channel_touch, FRDP, CHANNEL_TOUCH, GObject)
+
+typedef struct _FrdpChannelTouch FrdpChannelTouch;
+
+struct _FrdpChannelTouch
+{
+  GObject parent_instance;
+};
+
+struct _FrdpChannelTouchClass
+{
+  FrdpChannelClass parent_class;
+};
+
+void     frdp_channel_touch_update_contact (FrdpChannelTouch *self,
+                                            GdkEventSequence *sequence,
+                                            GdkEventType      type,
+                                            gint              x,
+                                            gint              y);
+
+void     frdp_channel_touch_flush          (FrdpChannelTouch *self);
+
+G_END_DECLS
@@ -19,9 +19,14 @@
 #include "frdp-display.h"
 
 #include "frdp-session.h"
+#include "frdp-channel-clipboard.h"
 
 #include <freerdp/channels/disp.h>
 
+#ifdef GDK_WINDOWING_WAYLAND
+#include <gdk/gdkwayland.h>
+#endif
+
 struct _FrdpDisplayPrivate
 {
   FrdpSession *session;
@@ -37,6 +42,15 @@ struct _FrdpDisplayPrivate
   guint        certificate_change_verification_value;
 
   gboolean     keyboard_grabbed;
+
+  gboolean     relative_pointer;
+  gboolean     pointer_grabbed;
+  gdouble      last_root_x;
+  gdouble      last_root_y;
+
+  GtkIMContext *im_context;
+  GdkEventKey  *im_key;          /* Key being filtered by the input method */
+  guint8        keys_down[256];  /* Keys whose press has been sent as scancode */
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (FrdpDisplay, frdp_display, GTK_TYPE_DRAWING_AREA)
@@ -49,7 +63,10 @@ enum
   PROP_SCALING,
   PROP_ALLOW_RESIZE,
   PROP_RESIZE_SUPPORTED,
-  PROP_DOMAIN
+  PROP_DOMAIN,
+  PROP_RELATIVE_POINTER,
+  PROP_CLIPBOARD_TIMEOUT,
+  PROP_CLIPBOARD_MAX_SIZE
 };
 
 enum
@@ -61,6 +78,7 @@ enum
   RDP_AUTH_FAILURE,
   RDP_NEEDS_CERTIFICATE_VERIFICATION,
   RDP_NEEDS_CERTIFICATE_CHANGE_VERIFICATION,
+  RDP_CLIPBOARD_PROGRESS,
   LAST_SIGNAL
 };
 
@@ -70,6 +88,10 @@ static void frdp_display_set_allow_resize (FrdpDisplay *display,
                                            gboolean     allow_resize);
 static void frdp_display_keyboard_grab    (FrdpDisplay *display);
 static void frdp_display_keyboard_ungrab  (FrdpDisplay *display);
+static void frdp_display_pointer_grab     (FrdpDisplay *display,
+                                           GdkEvent    *event);
+static void frdp_display_pointer_ungrab   (FrdpDisplay *display);
+static void frdp_display_pointer_warp     (FrdpDisplay *display);
 
 static gboolean
 frdp_display_is_initialized (FrdpDisplay *self)
@@ -79,6 +101,19 @@ frdp_display_is_initialized (FrdpDisplay *self)
   return priv->session != NULL && frdp_display_is_open (self);
 }
 
+static gboolean
+frdp_display_is_text_key (GdkEventKey *key)
+{
+  gunichar character;
+
+  if (key->state & (GDK_CONTROL_MASK | GDK_MOD1_MASK | GDK_SUPER_MASK | GDK_MOD4_MASK))
+    return FALSE;
+
+  character = gdk_keyval_to_unicode (key->keyval);
+
+  return character != 0 && !g_unichar_iscntrl (character);
+}
+
 static gboolean
 frdp_display_key_press_event (GtkWidget   *widget,
                               GdkEventKey *key)
@@ -89,11 +124,71 @@ frdp_display_key_press_event (GtkWidget   *widget,
   if (!frdp_display_is_initialized (self))
     return TRUE;
 
-  frdp_session_send_key (priv->session, key);
+  /* Ctrl+Alt releases the pointer captured in relative mode. */
+  if (priv->pointer_grabbed && key->type == GDK_KEY_PRESS &&
+      (((key->keyval == GDK_KEY_Alt_L || key->keyval == GDK_KEY_Alt_R) && (key->state & GDK_CONTROL_MASK)) ||
+       ((key->keyval == GDK_KEY_Control_L || key->keyval == GDK_KEY_Control_R) && (key->state & GDK_MOD1_MASK)))) {
+    frdp_display_pointer_ungrab (self);
+    frdp_display_keyboard_grab (self);
+  }
+
+  if (key->hardware_keycode >= G_N_ELEMENTS (priv->keys_down)) {
+    frdp_session_send_key (priv->session, key);
+    return TRUE;
+  }
+
+  if (key->type == GDK_KEY_PRESS) {
+    /* Shortcuts and keys not producing text keep using scancodes, so does
+     * everything if the server does not accept Unicode. */
+    if (!frdp_display_is_text_key (key) ||
+        !frdp_session_supports_unicode_input (priv->session)) {
+      priv->keys_down[key->hardware_keycode] = TRUE;
+      frdp_session_send_key (priv->session, key);
+    } else {
+      priv->im_key = key;
+      if (!gtk_im_context_filter_keypress (priv->im_context, key)) {
+        priv->keys_down[key->hardware_keycode] = TRUE;
+        frdp_session_send_key (priv->session, key);
+      }
+      priv->im_key = NULL;
+    }
+  } else {
+    if (priv->keys_down[key->hardware_keycode]) {
+      priv->keys_down[key->hardware_keycode] = FALSE;
+      frdp_session_send_key (priv->session, key);
+    } else {
+      gtk_im_context_filter_keypress (priv->im_context, key);
+    }
+  }
 
   return TRUE;
 }
 
+static void
+frdp_display_im_commit (GtkIMContext *im_context,
+                        const gchar  *text,
+                        gpointer      user_data)
+{
+  FrdpDisplay        *self = FRDP_DISPLAY (user_data);
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
+  GdkEventKey        *key = priv->im_key;
+
+  if (!frdp_display_is_initialized (self))
+    return;
+
+  /* Plain typing commits just the character of the pressed key. Send the
+   * scancode in that case so that held keys keep working, anything composed
+   * by the input method is sent as Unicode. */
+  if (key != NULL &&
+      g_utf8_strlen (text, -1) == 1 &&
+      g_utf8_get_char (text) == gdk_keyval_to_unicode (key->keyval)) {
+    priv->keys_down[key->hardware_keycode] = TRUE;
+    frdp_session_send_key (priv->session, key);
+  } else if (frdp_session_supports_unicode_input (priv->session)) {
+    frdp_session_send_text (priv->session, text);
+  }
+}
+
 static gboolean
 frdp_display_motion_notify_event (GtkWidget      *widget,
                                   GdkEventMotion *event)
@@ -104,6 +199,20 @@ frdp_display_motion_notify_event (GtkWidget      *widget,
   if (!frdp_display_is_initialized (self))
     return TRUE;
 
+  if (priv->relative_pointer) {
+    if (priv->pointer_grabbed &&
+        (event->x_root != priv->last_root_x || event->y_root != priv->last_root_y)) {
+      frdp_session_mouse_relative_event (priv->session,
+                                         event->x_root - priv->last_root_x,
+                                         event->y_root - priv->last_root_y);
+      priv->last_root_x = event->x_root;
+      priv->last_root_y = event->y_root;
+      frdp_display_pointer_warp (self);
+    }
+
+    return TRUE;
+  }
+
   frdp_session_mouse_event (priv->session,
                             FRDP_MOUSE_EVENT_MOVE,
                             event->x,
@@ -130,6 +239,14 @@ frdp_display_button_press_event (GtkWidget      *widget,
       (event->type != GDK_BUTTON_RELEASE))
     return FALSE;
 
+  /* The first click only captures the pointer in relative mode. */
+  if (priv->relative_pointer && !priv->pointer_grabbed) {
+    if (event->type == GDK_BUTTON_PRESS)
+      frdp_display_pointer_grab (self, (GdkEvent *) event);
+
+    return TRUE;
+  }
+
   if (event->type == GDK_BUTTON_PRESS)
     flags |= FRDP_MOUSE_EVENT_DOWN;
   switch(event->button) {
@@ -203,6 +320,49 @@ frdp_display_scroll_event (GtkWidget      *widget,
   return TRUE;
 }
 
+static gboolean
+frdp_display_touch_event (GtkWidget     *widget,
+                          GdkEventTouch *event)
+{
+  FrdpDisplay *self = FRDP_DISPLAY (widget);
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
+  guint16 flags = 0;
+
+  if (!frdp_display_is_initialized (self))
+    return TRUE;
+
+  if (frdp_session_touch_event (priv->session, event))
+    return TRUE;
+
+  /* Server has no touch input channel, emulate mouse with the first touch. */
+  if (!event->emulating_pointer)
+    return TRUE;
+
+  switch (event->type) {
+    case GDK_TOUCH_BEGIN:
+      flags = FRDP_MOUSE_EVENT_MOVE;
+      frdp_session_mouse_event (priv->session, flags, event->x, event->y);
+      flags = FRDP_MOUSE_EVENT_DOWN | FRDP_MOUSE_EVENT_BUTTON1;
+      break;
+    case GDK_TOUCH_UPDATE:
+      flags = FRDP_MOUSE_EVENT_MOVE;
+      break;
+    case GDK_TOUCH_END:
+    case GDK_TOUCH_CANCEL:
+      flags = FRDP_MOUSE_EVENT_BUTTON1;
+      break;
+    default:
+      return FALSE;
+  }
+
+  frdp_session_mouse_event (priv->session,
+                            flags,
+                            event->x,
+                            event->y);
+
+  return TRUE;
+}
+
 static gboolean
 frdp_enter_notify_event (GtkWidget        *widget,
                          GdkEventCrossing *event)
@@ -210,6 +370,9 @@ frdp_enter_notify_event (GtkWidget        *widget,
   FrdpDisplay *self = FRDP_DISPLAY (widget);
   FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
 
+  if (priv->pointer_grabbed)
+    return TRUE;
+
   frdp_session_mouse_pointer (priv->session, TRUE);
   frdp_display_keyboard_grab (self);
 
@@ -223,12 +386,63 @@ frdp_leave_notify_event (GtkWidget         *widget,
   FrdpDisplay *self = FRDP_DISPLAY (widget);
   FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
 
+  /* Crossing events caused by our own grab or warping must not release it. */
+  if (priv->pointer_grabbed)
+    return TRUE;
+
   frdp_session_mouse_pointer (priv->session, FALSE);
   frdp_display_keyboard_ungrab (self);
 
   return TRUE;
 }
 
+static gboolean
+frdp_focus_in_event (GtkWidget     *widget,
+                     GdkEventFocus *event)
+{
+  FrdpDisplay *self = FRDP_DISPLAY (widget);
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
+
+  gtk_im_context_focus_in (priv->im_context);
+
+  return FALSE;
+}
+
+static gboolean
+frdp_focus_out_event (GtkWidget     *widget,
+                      GdkEventFocus *event)
+{
+  FrdpDisplay *self = FRDP_DISPLAY (widget);
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
+
+  gtk_im_context_focus_out (priv->im_context);
+  frdp_display_pointer_ungrab (self);
+
+  return FALSE;
+}
+
+static void
+frdp_display_realize (GtkWidget *widget)
+{
+  FrdpDisplay *self = FRDP_DISPLAY (widget);
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
+
+  GTK_WIDGET_CLASS (frdp_display_parent_class)->realize (widget);
+
+  gtk_im_context_set_client_window (priv->im_context, gtk_widget_get_window (widget));
+}
+
+static void
+frdp_display_unrealize (GtkWidget *widget)
+{
+  FrdpDisplay *self = FRDP_DISPLAY (widget);
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
+
+  gtk_im_context_set_client_window (priv->im_context, NULL);
+
+  GTK_WIDGET_CLASS (frdp_display_parent_class)->unrealize (widget);
+}
+
 static void
 frdp_display_error (GObject     *source_object,
                     const gchar *message,
@@ -245,6 +459,15 @@ frdp_display_auth_failure (GObject     *source_object,
   g_signal_emit (user_data, signals[RDP_AUTH_FAILURE], 0, message);
 }
 
+static void
+frdp_display_clipboard_progress (GObject  *source_object,
+                                 guint64   bytes,
+                                 gdouble   rate,
+                                 gpointer  user_data)
+{
+  g_signal_emit (user_data, signals[RDP_CLIPBOARD_PROGRESS], 0, bytes, rate);
+}
+
 static void
 frdp_display_disconnected (GObject  *source_object,
                            gpointer  user_data)
@@ -255,6 +478,9 @@ frdp_display_disconnected (GObject  *source_object,
   g_signal_handlers_disconnect_by_func (priv->session, G_CALLBACK (frdp_display_error), self);
   g_signal_handlers_disconnect_by_func (priv->session, G_CALLBACK (frdp_display_disconnected), self);
   g_signal_handlers_disconnect_by_func (priv->session, G_CALLBACK (frdp_display_auth_failure), self);
+  g_signal_handlers_disconnect_by_func (priv->session, G_CALLBACK (frdp_display_clipboard_progress), self);
+
+  frdp_display_pointer_ungrab (self);
 
   g_signal_emit (self, signals[RDP_DISCONNECTED], 0);
 
@@ -296,6 +522,7 @@ frdp_display_get_property (GObject      *object,
   FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
   FrdpSession *session = priv->session;
   gpointer str_property;
+  guint uint_property;
 
   switch (property_id)
     {
@@ -321,6 +548,17 @@ frdp_display_get_property (GObject      *object,
       case PROP_RESIZE_SUPPORTED:
         g_value_set_boolean (value, priv->resize_supported);
         break;
+      case PROP_RELATIVE_POINTER:
+        g_value_set_boolean (value, priv->relative_pointer);
+        break;
+      case PROP_CLIPBOARD_TIMEOUT:
+        g_object_get (session, "clipboard-timeout", &uint_property, NULL);
+        g_value_set_uint (value, uint_property);
+        break;
+      case PROP_CLIPBOARD_MAX_SIZE:
+        g_object_get (session, "clipboard-max-size", &uint_property, NULL);
+        g_value_set_uint (value, uint_property);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -358,12 +596,34 @@ frdp_display_set_property (GObject      *object,
         priv->resize_supported = g_value_get_boolean (value);
         g_object_notify (G_OBJECT (self), "resize-supported");
         break;
+      case PROP_RELATIVE_POINTER:
+        frdp_display_set_relative_pointer (self, g_value_get_boolean (value));
+        break;
+      case PROP_CLIPBOARD_TIMEOUT:
+        g_object_set (session, "clipboard-timeout", g_value_get_uint (value), NULL);
+        break;
+      case PROP_CLIPBOARD_MAX_SIZE:
+        g_object_set (session, "clipboard-max-size", g_value_get_uint (value), NULL);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
     }
 }
 
+static void
+frdp_display_dispose (GObject *object)
+{
+  FrdpDisplay *self = FRDP_DISPLAY (object);
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (self);
+
+  if (priv->im_context != NULL)
+    g_signal_handlers_disconnect_by_func (priv->im_context, G_CALLBACK (frdp_display_im_commit), self);
+  g_clear_object (&priv->im_context);
+
+  G_OBJECT_CLASS (frdp_display_parent_class)->dispose (object);
+}
+
 static void
 frdp_display_class_init (FrdpDisplayClass *klass)
 {
@@ -372,6 +632,7 @@ frdp_display_class_init (FrdpDisplayClass *klass)
 
   gobject_class->get_property = frdp_display_get_property;
   gobject_class->set_property = frdp_display_set_property;
+  gobject_class->dispose = frdp_display_dispose;
 
   widget_class->key_press_event = frdp_display_key_press_event;
   widget_class->key_release_event = frdp_display_key_press_event;
@@ -379,8 +640,13 @@ frdp_display_class_init (FrdpDisplayClass *klass)
   widget_class->button_press_event = frdp_display_button_press_event;
   widget_class->button_release_event = frdp_display_button_press_event;
   widget_class->scroll_event = frdp_display_scroll_event;
+  widget_class->touch_event = frdp_display_touch_event;
   widget_class->enter_notify_event = frdp_enter_notify_event;
   widget_class->leave_notify_event = frdp_leave_notify_event;
+  widget_class->focus_in_event = frdp_focus_in_event;
+  widget_class->focus_out_event = frdp_focus_out_event;
+  widget_class->realize = frdp_display_realize;
+  widget_class->unrealize = frdp_display_unrealize;
 
   g_object_class_install_property (gobject_class,
                                    PROP_USERNAME,
@@ -430,6 +696,32 @@ frdp_display_class_init (FrdpDisplayClass *klass)
                                                          FALSE,
                                                          G_PARAM_READWRITE));
 
+  g_object_class_install_property (gobject_class,
+                                   PROP_RELATIVE_POINTER,
+                                   g_param_spec_boolean ("relative-pointer",
+                                                         "relative-pointer",
+                                                         "relative-pointer",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_CLIPBOARD_TIMEOUT,
+                                   g_param_spec_uint ("clipboard-timeout",
+                                                      "clipboard-timeout",
+                                                      "clipboard-timeout",
+                                                      0, G_MAXUINT,
+                                                      FRDP_CLIPBOARD_DEFAULT_TIMEOUT,
+                                                      G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_CLIPBOARD_MAX_SIZE,
+                                   g_param_spec_uint ("clipboard-max-size",
+                                                      "clipboard-max-size",
+                                                      "clipboard-max-size",
+                                                      0, G_MAXUINT,
+                                                      FRDP_CLIPBOARD_DEFAULT_MAX_SIZE,
+                                                      G_PARAM_READWRITE));
+
   signals[RDP_ERROR] = g_signal_new ("rdp-error",
                                      G_TYPE_FROM_CLASS (klass),
                                      G_SIGNAL_RUN_LAST,
@@ -490,6 +782,14 @@ frdp_display_class_init (FrdpDisplayClass *klass)
                                                                      G_TYPE_STRING,
                                                                      G_TYPE_STRING,
                                                                      G_TYPE_UINT);
+
+  signals[RDP_CLIPBOARD_PROGRESS] = g_signal_new ("rdp-clipboard-progress",
+                                                  G_TYPE_FROM_CLASS (klass),
+                                                  G_SIGNAL_RUN_LAST,
+                                                  0, NULL, NULL, NULL,
+                                                  G_TYPE_NONE, 2,
+                                                  G_TYPE_UINT64,
+                                                  G_TYPE_DOUBLE);
 }
 
 static void
@@ -503,12 +803,20 @@ frdp_display_init (FrdpDisplay *self)
                          GDK_BUTTON_RELEASE_MASK |
                          GDK_SCROLL_MASK |
                          GDK_SMOOTH_SCROLL_MASK |
+                         GDK_TOUCH_MASK |
                          GDK_KEY_PRESS_MASK |
                          GDK_ENTER_NOTIFY_MASK |
-                         GDK_LEAVE_NOTIFY_MASK);
+                         GDK_LEAVE_NOTIFY_MASK |
+                         GDK_FOCUS_CHANGE_MASK);
 
   gtk_widget_set_can_focus (GTK_WIDGET (self), TRUE);
 
+  /* Input methods show their own preedit window as the remote side
+   * receives only committed text. */
+  priv->im_context = gtk_im_multicontext_new ();
+  gtk_im_context_set_use_preedit (priv->im_context, FALSE);
+  g_signal_connect (priv->im_context, "commit", G_CALLBACK (frdp_display_im_commit), self);
+
   priv->session = frdp_session_new (self);
 
   g_object_bind_property (priv->session, "monitor-layout-supported", self, "resize-supported", 0);
@@ -541,6 +849,9 @@ frdp_display_open_host (FrdpDisplay  *display,
   g_signal_connect (priv->session, "rdp-auth-failure",
                     G_CALLBACK (frdp_display_auth_failure),
                     display);
+  g_signal_connect (priv->session, "rdp-clipboard-progress",
+                    G_CALLBACK (frdp_display_clipboard_progress),
+                    display);
 
   frdp_session_connect (priv->session,
                         host,
@@ -611,6 +922,36 @@ frdp_display_set_scaling (FrdpDisplay *display,
                               gtk_widget_get_allocated_height (GTK_WIDGET (display)));
 }
 
+/**
+ * frdp_display_set_relative_pointer:
+ * @display: (transfer none): the RDP display widget
+ * @relative_pointer: TRUE to send relative pointer motion, FALSE otherwise
+ *
+ * Set whether the pointer is captured by the display on click and its
+ * motion is sent as relative deltas instead of absolute positions.
+ * This is useful for games and CAD applications. Pressing Ctrl+Alt
+ * releases the captured pointer.
+ */
+void
+frdp_display_set_relative_pointer (FrdpDisplay *display,
+                                   gboolean     relative_pointer)
+{
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (display);
+
+  if (priv->relative_pointer == relative_pointer)
+    return;
+
+  priv->relative_pointer = relative_pointer;
+  g_object_set (priv->session, "relative-pointer", relative_pointer, NULL);
+
+  if (!relative_pointer && priv->pointer_grabbed) {
+    frdp_display_pointer_ungrab (display);
+    frdp_display_keyboard_grab (display);
+  }
+
+  g_object_notify (G_OBJECT (display), "relative-pointer");
+}
+
 static void
 frdp_display_set_allow_resize (FrdpDisplay *display,
                                gboolean     allow_resize)
@@ -889,3 +1230,79 @@ frdp_display_is_keyboard_grabbed (FrdpDisplay *self)
 
   return priv->keyboard_grabbed;
 }
+
+static void
+frdp_display_pointer_warp (FrdpDisplay *display)
+{
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (display);
+  GtkWidget          *widget = GTK_WIDGET (display);
+  GdkDevice          *pointer;
+  gint                x, y;
+
+#ifdef GDK_WINDOWING_WAYLAND
+  /* Wayland does not let clients move the pointer, the motion is then
+   * computed against the previous position. */
+  if (GDK_IS_WAYLAND_DISPLAY (gtk_widget_get_display (widget)))
+    return;
+#endif
+
+  pointer = gdk_seat_get_pointer (gdk_display_get_default_seat (gtk_widget_get_display (widget)));
+  gdk_window_get_origin (gtk_widget_get_window (widget), &x, &y);
+  x += gtk_widget_get_allocated_width (widget) / 2;
+  y += gtk_widget_get_allocated_height (widget) / 2;
+
+  /* Keep the pointer in the middle of the display so that it never
+   * reaches an edge, the motion is then computed against this point. */
+  gdk_device_warp (pointer, gtk_widget_get_screen (widget), x, y);
+  priv->last_root_x = x;
+  priv->last_root_y = y;
+}
+
+static void
+frdp_display_pointer_grab (FrdpDisplay *display,
+                           GdkEvent    *event)
+{
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (display);
+  GdkGrabStatus       status;
+  GdkCursor          *cursor;
+
+  if (priv->pointer_grabbed || !gtk_widget_get_realized (GTK_WIDGET (display)))
+    return;
+
+  cursor = gdk_cursor_new_for_display (gtk_widget_get_display (GTK_WIDGET (display)), GDK_BLANK_CURSOR);
+  status = gdk_seat_grab (gdk_display_get_default_seat (gtk_widget_get_display (GTK_WIDGET (display))),
+                          gtk_widget_get_window (GTK_WIDGET (display)),
+                          GDK_SEAT_CAPABILITY_ALL,
+                          TRUE,
+                          cursor,
+                          event,
+                          NULL,
+                          NULL);
+  g_object_unref (cursor);
+
+  if (status == GDK_GRAB_SUCCESS) {
+    priv->pointer_grabbed = TRUE;
+    priv->keyboard_grabbed = TRUE;
+
+    gdk_device_get_position_double (gdk_seat_get_pointer (gdk_display_get_default_seat (gtk_widget_get_display (GTK_WIDGET (display)))),
+                                    NULL,
+                                    &priv->last_root_x,
+                                    &priv->last_root_y);
+    frdp_display_pointer_warp (display);
+  } else {
+    g_warning ("pointer grab failed %d", status);
+  }
+}
+
+static void
+frdp_display_pointer_ungrab (FrdpDisplay *display)
+{
+  FrdpDisplayPrivate *priv = frdp_display_get_instance_private (display);
+
+  if (!priv->pointer_grabbed)
+    return;
+
+  gdk_seat_ungrab (gdk_display_get_default_seat (gtk_widget_get_display (GTK_WIDGET (display))));
+  priv->pointer_grabbed = FALSE;
+  priv->keyboard_grabbed = FALSE;
+}
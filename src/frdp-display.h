@@ -48,6 +48,9 @@ void       frdp_display_close     (FrdpDisplay *display);
 void       frdp_display_set_scaling (FrdpDisplay *display,
                                      gboolean     scaling);
 
+void       frdp_display_set_relative_pointer (FrdpDisplay *display,
+                                              gboolean     relative_pointer);
+
 gboolean   frdp_display_authenticate (FrdpDisplay *self,
                                       gchar **username,
                                       gchar **password,
@@ -42,15 +42,23 @@
 #include <gio/gio.h>
 #include <gtk/gtk.h>
 #include <math.h>
+#include <string.h>
 
 #include "frdp-session.h"
 #include "frdp-context.h"
 #include "frdp-channel-display-control.h"
 #include "frdp-channel-clipboard.h"
+#include "frdp-channel-touch.h"
 
 #define SELECT_TIMEOUT 50
 #define FRDP_CONNECTION_THREAD_MAX_ERRORS 10
 
+/* One wheel detent is 120 units of rotation, smooth scrolling is sent
+ * in multiples of 1/8 of it at most once per frame. */
+#define FRDP_WHEEL_DELTA      0x78
+#define FRDP_WHEEL_STEP       (FRDP_WHEEL_DELTA / 8)
+#define FRDP_WHEEL_MAX_VALUE  0xFF
+
 #ifdef HAVE_FREERDP3
 #define CONST_QUALIFIER const
 #else
@@ -76,6 +84,16 @@ struct _FrdpSessionPrivate
   double offset_x;
   double offset_y;
 
+  gboolean relative_pointer;
+  double pointer_x;             /* Last pointer position in remote desktop coordinates */
+  double pointer_y;
+  double relative_remainder_x;  /* Sub-pixel motion not sent yet */
+  double relative_remainder_y;
+
+  double scroll_accumulator_x;  /* Rotation not sent yet, positive is right */
+  double scroll_accumulator_y;  /* Rotation not sent yet, positive is up */
+  guint  scroll_tick_id;
+
   guint update_id;
 
   gboolean is_connected;
@@ -93,8 +111,15 @@ struct _FrdpSessionPrivate
   /* Channels */
   FrdpChannelDisplayControl *display_control_channel;
   FrdpChannelClipboard      *clipboard_channel;
+  guint                      clipboard_timeout;
+  guint                      clipboard_max_size;
+  FrdpChannelTouch          *touch_channel;
+  guint                      touch_tick_id;
   gboolean                   monitor_layout_supported;
 
+  GSettings *input_sources;
+  guint32    keycode_scancodes[256];
+
   GQueue *area_draw_queue;  /* elem: GdkRectangle */
   GMutex  area_draw_mutex;
 };
@@ -111,7 +136,10 @@ enum
   PROP_DISPLAY,
   PROP_SCALING,
   PROP_MONITOR_LAYOUT_SUPPORTED,
-  PROP_DOMAIN
+  PROP_DOMAIN,
+  PROP_RELATIVE_POINTER,
+  PROP_CLIPBOARD_TIMEOUT,
+  PROP_CLIPBOARD_MAX_SIZE
 };
 
 enum
@@ -121,6 +149,7 @@ enum
   RDP_DISCONNECTED,
   RDP_AUTH_FAILURE,
   RDP_CHANNEL_CONNECTED,
+  RDP_CLIPBOARD_PROGRESS,
   LAST_SIGNAL
 };
 
@@ -342,6 +371,26 @@ frdp_session_set_scaling (FrdpSession *self,
   self->priv->scaling = scaling;
 }
 
+static void
+frdp_session_set_relative_pointer (FrdpSession *self,
+                                   gboolean     relative_pointer)
+{
+  FrdpSessionPrivate *priv = self->priv;
+
+  priv->relative_pointer = relative_pointer;
+  priv->relative_remainder_x = 0.0;
+  priv->relative_remainder_y = 0.0;
+}
+
+#ifdef HAVE_FREERDP3
+static gboolean
+frdp_session_has_relative_mouse_event (FrdpSession *self)
+{
+  return freerdp_settings_get_bool (self->priv->freerdp_session->context->settings,
+                                    FreeRDP_HasRelativeMouseEvent);
+}
+#endif
+
 static gboolean
 frdp_session_draw (GtkWidget *widget,
                    cairo_t   *cr,
@@ -449,6 +498,15 @@ caps_set (FrdpChannelDisplayControl *channel,
   g_object_set (G_OBJECT (session), "monitor-layout-supported", TRUE, NULL);
 }
 
+static void
+clipboard_transfer_progress (FrdpChannelClipboard *channel,
+                             guint64               bytes,
+                             gdouble               rate,
+                             gpointer              user_data)
+{
+  g_signal_emit (user_data, signals[RDP_CLIPBOARD_PROGRESS], 0, bytes, rate);
+}
+
 static void
 frdp_on_channel_connected_event_handler (void                                      *context,
                                          CONST_QUALIFIER ChannelConnectedEventArgs *e)
@@ -458,7 +516,12 @@ frdp_on_channel_connected_event_handler (void
   FrdpSessionPrivate *priv = frdp_session_get_instance_private (session);
 
   if (strcmp (e->name, RDPEI_DVC_CHANNEL_NAME) == 0) {
-    // TODO Touch input redirection
+    g_clear_object (&priv->touch_channel);
+
+    priv->touch_channel = g_object_new (FRDP_TYPE_CHANNEL_TOUCH,
+                                        "session", session,
+                                        "rdpei-client-context", (RdpeiClientContext *) e->pInterface,
+                                        NULL);
   } else if (strcmp (e->name, DISP_DVC_CHANNEL_NAME) == 0) {
     g_clear_object (&priv->display_control_channel);
 
@@ -474,12 +537,17 @@ frdp_on_channel_connected_event_handler (void
   } else if (strcmp (e->name, RAIL_SVC_CHANNEL_NAME) == 0) {
     // TODO Remote application
   } else if (strcmp (e->name, CLIPRDR_SVC_CHANNEL_NAME) == 0) {
+    if (priv->clipboard_channel != NULL)
+      frdp_channel_clipboard_detach (priv->clipboard_channel);
     g_clear_object (&priv->clipboard_channel);
 
     priv->clipboard_channel = g_object_new (FRDP_TYPE_CHANNEL_CLIPBOARD,
                                             "session", session,
                                             "cliprdr-client-context", (CliprdrClientContext *) e->pInterface,
+                                            "request-timeout", priv->clipboard_timeout,
+                                            "max-data-size", priv->clipboard_max_size,
                                             NULL);
+    g_signal_connect (priv->clipboard_channel, "transfer-progress", G_CALLBACK (clipboard_transfer_progress), session);
   } else if (strcmp (e->name, ENCOMSP_SVC_CHANNEL_NAME) == 0) {
     // TODO Multiparty channel
   } else if (strcmp (e->name, GEOMETRY_DVC_CHANNEL_NAME) == 0) {
@@ -500,7 +568,7 @@ frdp_on_channel_disconnected_event_handler (void
   FrdpSessionPrivate *priv = frdp_session_get_instance_private (session);
 
   if (strcmp (e->name, RDPEI_DVC_CHANNEL_NAME) == 0) {
-    // TODO Touch input redirection
+    g_clear_object (&priv->touch_channel);
   } else if (strcmp (e->name, DISP_DVC_CHANNEL_NAME) == 0) {
     g_clear_object (&priv->display_control_channel);
   } else if (strcmp (e->name, TSMF_DVC_CHANNEL_NAME) == 0) {
@@ -510,6 +578,8 @@ frdp_on_channel_disconnected_event_handler (void
   } else if (strcmp (e->name, RAIL_SVC_CHANNEL_NAME) == 0) {
     // TODO Remote application
   } else if (strcmp (e->name, CLIPRDR_SVC_CHANNEL_NAME) == 0) {
+    if (priv->clipboard_channel != NULL)
+      frdp_channel_clipboard_detach (priv->clipboard_channel);
     g_clear_object (&priv->clipboard_channel);
   } else if (strcmp (e->name, ENCOMSP_SVC_CHANNEL_NAME) == 0) {
     // TODO Multiparty channel
@@ -720,6 +790,16 @@ idle_close (gpointer user_data)
 
   self->priv->is_connected = FALSE;
 
+  if (self->priv->scroll_tick_id > 0) {
+    gtk_widget_remove_tick_callback (self->priv->display, self->priv->scroll_tick_id);
+    self->priv->scroll_tick_id = 0;
+  }
+
+  if (self->priv->touch_tick_id > 0) {
+    gtk_widget_remove_tick_callback (self->priv->display, self->priv->touch_tick_id);
+    self->priv->touch_tick_id = 0;
+  }
+
   if (self->priv->update_id > 0) {
     g_source_remove (self->priv->update_id);
     self->priv->update_id = 0;
@@ -812,7 +892,7 @@ static const struct {
   { "ara", KBD_ARABIC_101 },
   { "bg", KBD_BULGARIAN },
   { "cz", KBD_CZECH },
-  { "da", KBD_DANISH },
+  { "dk", KBD_DANISH },
   { "de", KBD_GERMAN },
   { "gr", KBD_GREEK },
   { "us", KBD_US },
@@ -828,7 +908,6 @@ static const struct {
   { "nl", KBD_DUTCH },
   { "no", KBD_NORWEGIAN },
   { "pl+dvp", KBD_POLISH_PROGRAMMERS },
-  { "pt", KBD_PORTUGUESE_BRAZILIAN_ABNT },
   { "ro", KBD_ROMANIAN },
   { "ru", KBD_RUSSIAN },
   { "hr", KBD_CROATIAN },
@@ -868,7 +947,7 @@ static const struct {
   { "us+dvorak", KBD_UNITED_STATES_DVORAK },
   { "it+ibm", KBD_ITALIAN_142 },
   { "pl+qwertz", KBD_POLISH_214 },
-  { "pt", KBD_PORTUGUESE_BRAZILIAN_ABNT2 },
+  { "br", KBD_PORTUGUESE_BRAZILIAN_ABNT2 },
   { "sk+qwerty", KBD_SLOVAK_QWERTY },
   { "th+pat", KBD_THAI_PATTACHOTE },
   { "tr+f", KBD_TURKISH_F },
@@ -883,55 +962,56 @@ static const struct {
   { "gr+polytonic", KBD_GREEK_POLYTONIC },
   { "fr+bepo", KBD_FRENCH_BEPO },
   { "de+neo", KBD_GERMAN_NEO },
+  { "tw", KBD_CHINESE_TRADITIONAL_US },
+  { "th", KBD_THAI_KEDMANEE },
+  { "ir", KBD_FARSI },
+  { "az", KBD_AZERI_LATIN },
+  { "in", KBD_DEVANAGARI_INSCRIPT },
+  { "mt", KBD_MALTESE_47_KEY },
+  { "kg", KBD_KYRGYZ_CYRILLIC },
+  { "ru+tt", KBD_TATAR },
+  { "in+ben", KBD_BENGALI },
+  { "in+guru", KBD_PUNJABI },
+  { "in+guj", KBD_GUJARATI },
+  { "in+tam", KBD_TAMIL },
+  { "in+tel", KBD_TELUGU },
+  { "in+kan", KBD_KANNADA },
+  { "in+mal", KBD_MALAYALAM },
+  { "in+marathi", KBD_MARATHI },
+  { "mn", KBD_MONGOLIAN_CYRILLIC },
+  { "np", KBD_NEPALI },
+  { "cn", KBD_CHINESE_SIMPLIFIED_US },
+  { "rs+latin", KBD_SERBIAN_LATIN },
+  { "az+cyrillic", KBD_AZERI_CYRILLIC },
+  { "se+smi", KBD_SWEDISH_WITH_SAMI },
+  { "uz", KBD_UZBEK_CYRILLIC },
+  { "rs", KBD_SERBIAN_CYRILLIC },
+  { "ch+fr", KBD_SWISS_FRENCH },
+  { "ie", KBD_IRISH },
+  { "ru+typewriter", KBD_RUSSIAN_TYPEWRITER },
+  { "in+ben_inscript", KBD_BENGALI_INSCRIPT },
+  { "sy+syc_phonetic", KBD_SYRIAC_PHONETIC },
+  { "mv", KBD_DIVEHI_TYPEWRITER },
+  { "fi+smi", KBD_FINNISH_WITH_SAMI },
+  { "ca+multix", KBD_CANADIAN_MULTILINGUAL_STANDARD },
+  { "ara+azerty", KBD_ARABIC_102_AZERTY },
 
   /* These need to be determined yet. */
 
-  { "", KBD_CHINESE_TRADITIONAL_US },
-  { "", KBD_THAI_KEDMANEE },
-  { "", KBD_FARSI },
-  { "", KBD_AZERI_LATIN },
-  { "", KBD_DEVANAGARI_INSCRIPT },
-  { "", KBD_MALTESE_47_KEY },
-  { "", KBD_KYRGYZ_CYRILLIC },
-  { "", KBD_TATAR },
-  { "", KBD_BENGALI },
-  { "", KBD_PUNJABI },
-  { "", KBD_GUJARATI },
-  { "", KBD_TAMIL },
-  { "", KBD_TELUGU },
-  { "", KBD_KANNADA },
-  { "", KBD_MALAYALAM },
-  { "", KBD_MARATHI },
-  { "", KBD_MONGOLIAN_CYRILLIC },
-  { "", KBD_NEPALI },
+  { "", KBD_PORTUGUESE_BRAZILIAN_ABNT },
   { "", KBD_LUXEMBOURGISH },
-  { "", KBD_CHINESE_SIMPLIFIED_US },
   { "", KBD_BELGIAN_PERIOD },
-  { "", KBD_SERBIAN_LATIN },
-  { "", KBD_AZERI_CYRILLIC },
-  { "", KBD_SWEDISH_WITH_SAMI },
-  { "", KBD_UZBEK_CYRILLIC },
   { "", KBD_INUKTITUT_LATIN },
-  { "", KBD_SERBIAN_CYRILLIC },
-  { "", KBD_SWISS_FRENCH },
-  { "", KBD_IRISH },
   { "", KBD_BOSNIAN_CYRILLIC },
   { "", KBD_ARABIC_102 },
   { "", KBD_BULGARIAN_LATIN },
   { "", KBD_GREEK_220 },
   { "", KBD_SPANISH_VARIATION },
   { "", KBD_HUNGARIAN_101_KEY },
-  { "", KBD_RUSSIAN_TYPEWRITER },
   { "", KBD_LATVIAN_QWERTY },
   { "", KBD_HINDI_TRADITIONAL },
   { "", KBD_MALTESE_48_KEY },
   { "", KBD_SAMI_EXTENDED_NORWAY },
-  { "", KBD_BENGALI_INSCRIPT },
-  { "", KBD_SYRIAC_PHONETIC },
-  { "", KBD_DIVEHI_TYPEWRITER },
-  { "", KBD_FINNISH_WITH_SAMI },
-  { "", KBD_CANADIAN_MULTILINGUAL_STANDARD },
-  { "", KBD_ARABIC_102_AZERTY },
   { "", KBD_CZECH_PROGRAMMERS },
   { "", KBD_GREEK_319 },
   { "", KBD_THAI_KEDMANEE_NON_SHIFTLOCK },
@@ -954,53 +1034,127 @@ static const struct {
 */
 };
 
-static void
-frdp_session_set_current_keyboard_layout (FrdpSession *self) {
-  GSettingsSchemaSource *source;
-  FrdpSessionPrivate    *priv = self->priv;
-  GSettingsSchema       *schema;
-  rdpSettings           *settings;
-  const gchar           *source_type = NULL, *layout = NULL;
-  GSettings             *gsettings;
-  GVariant              *sources;
-  gboolean               keyboard_layout_set = FALSE;
-  guint                  i;
+/* Index of keyboard_layouts[] by local layout, the first entry wins. */
+static GHashTable *
+get_keyboard_layouts_index (void)
+{
+  static gsize       initialized = 0;
+  static GHashTable *index = NULL;
+  GHashTable        *table;
+  guint              i;
+
+  if (g_once_init_enter (&initialized)) {
+    table = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < G_N_ELEMENTS (keyboard_layouts); i++) {
+      if (keyboard_layouts[i].local_layout[0] != '\0' &&
+          !g_hash_table_contains (table, keyboard_layouts[i].local_layout))
+        g_hash_table_insert (table,
+                             (gpointer) keyboard_layouts[i].local_layout,
+                             GUINT_TO_POINTER (keyboard_layouts[i].freerdp_layout));
+    }
 
-  settings = priv->freerdp_session->context->settings;
+    index = table;
+    g_once_init_leave (&initialized, 1);
+  }
 
-  source = g_settings_schema_source_get_default ();
-  if (source != NULL) {
-    schema = g_settings_schema_source_lookup (source, "org.gnome.desktop.input-sources", TRUE);
-    if (schema != NULL) {
-      gsettings = g_settings_new (g_settings_schema_get_id (schema));
-      sources = g_settings_get_value (gsettings, "mru-sources");
+  return index;
+}
+
+/*
+ * Looks up "layout+variant" first and falls back to just "layout"
+ * so that unknown variants get at least the base national layout.
+ */
+static gboolean
+lookup_keyboard_layout (const gchar *local_layout,
+                        guint       *freerdp_layout)
+{
+  GHashTable  *index = get_keyboard_layouts_index ();
+  const gchar *plus;
+  gpointer     value;
+  gchar       *base;
+
+  value = g_hash_table_lookup (index, local_layout);
+  if (value == NULL && (plus = strchr (local_layout, '+')) != NULL) {
+    base = g_strndup (local_layout, plus - local_layout);
+    value = g_hash_table_lookup (index, base);
+    g_free (base);
+  }
+
+  if (value == NULL)
+    return FALSE;
+
+  *freerdp_layout = GPOINTER_TO_UINT (value);
+
+  return TRUE;
+}
+
+/* Takes the first source which has a known layout (input method engines are skipped). */
+static gboolean
+find_keyboard_layout (GSettings   *input_sources,
+                      const gchar *key,
+                      guint       *freerdp_layout)
+{
+  GVariantIter  iter;
+  const gchar  *source_type, *source_id;
+  gboolean      found = FALSE;
+  GVariant     *sources;
+
+  sources = g_settings_get_value (input_sources, key);
 
-      if (g_variant_n_children (sources) >= 1)
-        g_variant_get_child (sources, 0, "(&s&s)", &source_type, &layout);
+  g_variant_iter_init (&iter, sources);
+  while (!found && g_variant_iter_next (&iter, "(&s&s)", &source_type, &source_id))
+    found = lookup_keyboard_layout (source_id, freerdp_layout);
 
-      if (layout != NULL) {
-        for (i = 0; i < G_N_ELEMENTS (keyboard_layouts); i++) {
-          if (g_strcmp0 (layout, keyboard_layouts[i].local_layout) == 0) {
+  g_variant_unref (sources);
+
+  return found;
+}
+
+/*
+ * Keycodes are translated to scancodes once per connection so that
+ * frdp_session_send_key() does not need to do any conversion.
+ */
+static void
+frdp_session_update_keycode_table (FrdpSession *self)
+{
+  FrdpSessionPrivate *priv = self->priv;
+  guint               keycode;
+
+  for (keycode = 0; keycode < G_N_ELEMENTS (priv->keycode_scancodes); keycode++) {
 #ifdef HAVE_FREERDP_3_11_0
-            settings->KeyboardLayout = keyboard_layouts[i].freerdp_layout;
+    priv->keycode_scancodes[keycode] =
+      GetVirtualScanCodeFromVirtualKeyCode (GetVirtualKeyCodeFromKeycode (keycode, WINPR_KEYCODE_TYPE_XKB),
+                                            WINPR_KBD_TYPE_IBM_ENHANCED);
 #else
-            settings->KeyboardLayout = freerdp_keyboard_init (keyboard_layouts[i].freerdp_layout);
+    priv->keycode_scancodes[keycode] = freerdp_keyboard_get_rdp_scancode_from_x11_keycode (keycode);
 #endif
-            keyboard_layout_set = TRUE;
-            break;
-          }
-        }
-      }
+  }
+}
 
-      g_variant_unref (sources);
-      g_object_unref (gsettings);
-      g_settings_schema_unref (schema);
-    }
+static void
+frdp_session_set_current_keyboard_layout (FrdpSession *self)
+{
+  FrdpSessionPrivate *priv = self->priv;
+  rdpSettings        *settings;
+  gboolean            keyboard_layout_set = FALSE;
+  guint               layout = 0;
+
+  if (priv->freerdp_session == NULL)
+    return;
+
+  settings = priv->freerdp_session->context->settings;
+
+  if (priv->input_sources != NULL) {
+    keyboard_layout_set = find_keyboard_layout (priv->input_sources, "mru-sources", &layout) ||
+                          find_keyboard_layout (priv->input_sources, "sources", &layout);
   }
 
-#ifndef HAVE_FREERDP_3_11_0
-  if (!keyboard_layout_set)
-    settings->KeyboardLayout = freerdp_keyboard_init (0);
+#ifdef HAVE_FREERDP_3_11_0
+  if (keyboard_layout_set)
+    settings->KeyboardLayout = layout;
+#else
+  settings->KeyboardLayout = freerdp_keyboard_init (keyboard_layout_set ? layout : 0);
 #endif
 }
 
@@ -1064,6 +1218,10 @@ frdp_session_init_freerdp (FrdpSession *self)
   settings->ColorDepth = 32;
   settings->RedirectClipboard = TRUE;
   settings->SupportGraphicsPipeline = TRUE;
+  settings->MultiTouchInput = TRUE;
+#ifdef HAVE_FREERDP3
+  settings->HasRelativeMouseEvent = TRUE;
+#endif
 
   freerdp_client_add_dynamic_channel (settings, count, collections);
 
@@ -1078,6 +1236,7 @@ frdp_session_init_freerdp (FrdpSession *self)
   g_free (build_options);
 
   frdp_session_set_current_keyboard_layout (self);
+  frdp_session_update_keycode_table (self);
 
   freerdp_register_addin_provider(freerdp_channels_load_static_addin_entry, 0);
 
@@ -1203,6 +1362,15 @@ frdp_session_get_property (GObject    *object,
       case PROP_MONITOR_LAYOUT_SUPPORTED:
         g_value_set_boolean (value, self->priv->monitor_layout_supported);
         break;
+      case PROP_RELATIVE_POINTER:
+        g_value_set_boolean (value, self->priv->relative_pointer);
+        break;
+      case PROP_CLIPBOARD_TIMEOUT:
+        g_value_set_uint (value, self->priv->clipboard_timeout);
+        break;
+      case PROP_CLIPBOARD_MAX_SIZE:
+        g_value_set_uint (value, self->priv->clipboard_max_size);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1248,6 +1416,19 @@ frdp_session_set_property (GObject      *object,
         self->priv->monitor_layout_supported = g_value_get_boolean (value);
         g_object_notify (G_OBJECT (self), "monitor-layout-supported");
         break;
+      case PROP_RELATIVE_POINTER:
+        frdp_session_set_relative_pointer (self, g_value_get_boolean (value));
+        break;
+      case PROP_CLIPBOARD_TIMEOUT:
+        self->priv->clipboard_timeout = g_value_get_uint (value);
+        if (self->priv->clipboard_channel != NULL)
+          g_object_set (self->priv->clipboard_channel, "request-timeout", self->priv->clipboard_timeout, NULL);
+        break;
+      case PROP_CLIPBOARD_MAX_SIZE:
+        self->priv->clipboard_max_size = g_value_get_uint (value);
+        if (self->priv->clipboard_channel != NULL)
+          g_object_set (self->priv->clipboard_channel, "max-data-size", self->priv->clipboard_max_size, NULL);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1261,6 +1442,8 @@ frdp_session_finalize (GObject *object)
 
   idle_close (self);
 
+  g_clear_object (&self->priv->input_sources);
+
   G_OBJECT_CLASS (frdp_session_parent_class)->finalize (object);
 }
 
@@ -1337,6 +1520,32 @@ frdp_session_class_init (FrdpSessionClass *klass)
                                                          FALSE,
                                                          G_PARAM_READWRITE));
 
+  g_object_class_install_property (gobject_class,
+                                   PROP_RELATIVE_POINTER,
+                                   g_param_spec_boolean ("relative-pointer",
+                                                         "relative-pointer",
+                                                         "Send pointer motion as relative deltas",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_CLIPBOARD_TIMEOUT,
+                                   g_param_spec_uint ("clipboard-timeout",
+                                                      "clipboard-timeout",
+                                                      "Time in milliseconds to wait for remote clipboard data, 0 waits forever",
+                                                      0, G_MAXUINT,
+                                                      FRDP_CLIPBOARD_DEFAULT_TIMEOUT,
+                                                      G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_CLIPBOARD_MAX_SIZE,
+                                   g_param_spec_uint ("clipboard-max-size",
+                                                      "clipboard-max-size",
+                                                      "Maximum size of clipboard data in bytes, 0 means no limit",
+                                                      0, G_MAXUINT,
+                                                      FRDP_CLIPBOARD_DEFAULT_MAX_SIZE,
+                                                      G_PARAM_READWRITE));
+
   signals[RDP_ERROR] = g_signal_new ("rdp-error",
                                      FRDP_TYPE_SESSION,
                                      G_SIGNAL_RUN_FIRST,
@@ -1362,15 +1571,37 @@ frdp_session_class_init (FrdpSessionClass *klass)
                                             0, NULL, NULL, NULL,
                                             G_TYPE_NONE, 1,
                                             G_TYPE_STRING);
+
+  signals[RDP_CLIPBOARD_PROGRESS] = g_signal_new ("rdp-clipboard-progress",
+                                                  FRDP_TYPE_SESSION,
+                                                  G_SIGNAL_RUN_FIRST,
+                                                  0, NULL, NULL, NULL,
+                                                  G_TYPE_NONE, 2,
+                                                  G_TYPE_UINT64,
+                                                  G_TYPE_DOUBLE);
 }
 
 static void
 frdp_session_init (FrdpSession *self)
 {
+  GSettingsSchemaSource *source;
+  GSettingsSchema       *schema;
+
   self->priv = frdp_session_get_instance_private (self);
 
   g_mutex_init (&self->priv->area_draw_mutex);
   self->priv->area_draw_queue = g_queue_new ();
+  self->priv->clipboard_timeout = FRDP_CLIPBOARD_DEFAULT_TIMEOUT;
+  self->priv->clipboard_max_size = FRDP_CLIPBOARD_DEFAULT_MAX_SIZE;
+
+  source = g_settings_schema_source_get_default ();
+  if (source != NULL) {
+    schema = g_settings_schema_source_lookup (source, "org.gnome.desktop.input-sources", TRUE);
+    if (schema != NULL) {
+      self->priv->input_sources = g_settings_new (g_settings_schema_get_id (schema));
+      g_settings_schema_unref (schema);
+    }
+  }
 
   self->priv->is_connected = FALSE;
 }
@@ -1485,9 +1716,27 @@ frdp_session_mouse_event (FrdpSession          *self,
 
   input = priv->freerdp_session->context->input;
 
-  if (priv->scaling) {
-    x = (x - priv->offset_x) / priv->scale;
-    y = (y - priv->offset_y) / priv->scale;
+  if (priv->relative_pointer) {
+    /* The local pointer is grabbed and warped, only the remote position matters. */
+#ifdef HAVE_FREERDP3
+    /* Wheel rotation has no relative variant, it goes through the absolute path. */
+    if (frdp_session_has_relative_mouse_event (self) &&
+        (flags & (PTR_FLAGS_WHEEL | PTR_FLAGS_HWHEEL)) == 0) {
+      if (xflags != 0 || (flags & ~PTR_FLAGS_MOVE) != 0)
+        freerdp_input_send_rel_mouse_event (input, (flags & ~PTR_FLAGS_MOVE) | xflags, 0, 0);
+      return;
+    }
+#endif
+    x = priv->pointer_x;
+    y = priv->pointer_y;
+  } else {
+    if (priv->scaling) {
+      x = (x - priv->offset_x) / priv->scale;
+      y = (y - priv->offset_y) / priv->scale;
+    }
+
+    priv->pointer_x = x;
+    priv->pointer_y = y;
   }
 
   x = x < 0.0 ? 0.0 : x;
@@ -1501,6 +1750,54 @@ frdp_session_mouse_event (FrdpSession          *self,
   }
 }
 
+static void
+frdp_session_send_wheel (FrdpSession *self,
+                         guint16      axis_flags,
+                         double      *accumulator)
+{
+  FrdpSessionPrivate *priv = self->priv;
+  rdpInput           *input = priv->freerdp_session->context->input;
+  guint16             flags, value;
+
+  while (fabs (*accumulator) >= FRDP_WHEEL_STEP) {
+    value = MIN ((guint) (fabs (*accumulator) / FRDP_WHEEL_STEP) * FRDP_WHEEL_STEP,
+                 FRDP_WHEEL_MAX_VALUE / FRDP_WHEEL_STEP * FRDP_WHEEL_STEP);
+
+    flags = axis_flags;
+    if (*accumulator > 0.0) {
+      flags |= value & WheelRotationMask;
+      *accumulator -= value;
+    } else {
+      flags |= PTR_FLAGS_WHEEL_NEGATIVE;
+      flags |= (~value + 1) & WheelRotationMask;
+      *accumulator += value;
+    }
+
+    freerdp_input_send_mouse_event (input,
+                                    flags,
+                                    (guint16) priv->pointer_x,
+                                    (guint16) priv->pointer_y);
+  }
+}
+
+static gboolean
+frdp_session_scroll_tick (GtkWidget     *widget,
+                          GdkFrameClock *frame_clock,
+                          gpointer       user_data)
+{
+  FrdpSession        *self = user_data;
+  FrdpSessionPrivate *priv = self->priv;
+
+  priv->scroll_tick_id = 0;
+
+  if (priv->freerdp_session != NULL) {
+    frdp_session_send_wheel (self, PTR_FLAGS_WHEEL, &priv->scroll_accumulator_y);
+    frdp_session_send_wheel (self, PTR_FLAGS_HWHEEL, &priv->scroll_accumulator_x);
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
 void
 frdp_session_mouse_smooth_scroll_event (FrdpSession          *self,
                                         guint16               x,
@@ -1509,47 +1806,124 @@ frdp_session_mouse_smooth_scroll_event (FrdpSession          *self,
                                         double                delta_y)
 {
   FrdpSessionPrivate *priv = self->priv;
-  rdpInput           *input;
-  guint16             flags = 0, value;
 
   g_return_if_fail (priv->freerdp_session != NULL);
 
-  if (fabs (delta_y) >= fabs (delta_x)) {
-    flags |= PTR_FLAGS_WHEEL;
-    value = (guint16) round (fabs (delta_y) * 0x78);
-    if (value > 0) {
-      /* Reversing direction here to reflect the behaviour on local side. */
-      if (delta_y < 0.0) {
-        if (value > 255)
-          value = 255;
-        flags |= value & WheelRotationMask;
-      } else {
-        if (value > 256)
-          value = 256;
-        flags |= PTR_FLAGS_WHEEL_NEGATIVE;
-        flags |= (~value + 1) & WheelRotationMask;
-      }
-    }
-  } else {
-    flags |= PTR_FLAGS_HWHEEL;
-    value = (guint16) round (fabs (delta_x) * 0x78);
-    if (value > 0) {
-      if (delta_x < 0.0) {
-        if (value > 256)
-          value = 256;
-        flags |= PTR_FLAGS_WHEEL_NEGATIVE;
-        flags |= (~value + 1) & WheelRotationMask;
-      } else {
-        if (value > 255)
-          value = 255;
-        flags |= value & WheelRotationMask;
-      }
+  if (!priv->relative_pointer) {
+    if (priv->scaling) {
+      priv->pointer_x = MAX ((x - priv->offset_x) / priv->scale, 0.0);
+      priv->pointer_y = MAX ((y - priv->offset_y) / priv->scale, 0.0);
+    } else {
+      priv->pointer_x = x;
+      priv->pointer_y = y;
     }
   }
 
+  /* Reversing vertical direction here to reflect the behaviour on local side.
+   * Remainders smaller than a step are kept for the next events so that
+   * small touchpad deltas are not lost. */
+  priv->scroll_accumulator_y -= delta_y * FRDP_WHEEL_DELTA;
+  priv->scroll_accumulator_x += delta_x * FRDP_WHEEL_DELTA;
+
+  /* Whole bursts of events within one frame are sent together. */
+  if (priv->scroll_tick_id == 0)
+    priv->scroll_tick_id = gtk_widget_add_tick_callback (priv->display,
+                                                         frdp_session_scroll_tick,
+                                                         self,
+                                                         NULL);
+}
+
+void
+frdp_session_mouse_relative_event (FrdpSession          *self,
+                                   double                delta_x,
+                                   double                delta_y)
+{
+  FrdpSessionPrivate *priv = self->priv;
+  rdpSettings        *settings;
+  rdpInput           *input;
+  double              scale;
+
+  g_return_if_fail (priv->freerdp_session != NULL);
+
   input = priv->freerdp_session->context->input;
+  settings = priv->freerdp_session->context->settings;
+
+  /* Track the position on the remote side so that button events and the
+   * absolute fallback below land where the remote cursor actually is. */
+  scale = priv->scaling && priv->scale > 0.0 ? priv->scale : 1.0;
+  priv->pointer_x = CLAMP (priv->pointer_x + delta_x / scale, 0.0, settings->DesktopWidth - 1.0);
+  priv->pointer_y = CLAMP (priv->pointer_y + delta_y / scale, 0.0, settings->DesktopHeight - 1.0);
+
+#ifdef HAVE_FREERDP3
+  if (frdp_session_has_relative_mouse_event (self)) {
+    gint16 dx, dy;
+
+    /* Device deltas are sent unscaled, keep fractional parts for later. */
+    priv->relative_remainder_x += delta_x;
+    priv->relative_remainder_y += delta_y;
+    dx = (gint16) CLAMP (trunc (priv->relative_remainder_x), G_MININT16, G_MAXINT16);
+    dy = (gint16) CLAMP (trunc (priv->relative_remainder_y), G_MININT16, G_MAXINT16);
+    priv->relative_remainder_x -= dx;
+    priv->relative_remainder_y -= dy;
+
+    if (dx != 0 || dy != 0)
+      freerdp_input_send_rel_mouse_event (input, PTR_FLAGS_MOVE, dx, dy);
+
+    return;
+  }
+#endif
+
+  freerdp_input_send_mouse_event (input,
+                                  PTR_FLAGS_MOVE,
+                                  (guint16) priv->pointer_x,
+                                  (guint16) priv->pointer_y);
+}
+
+static gboolean
+frdp_session_touch_tick (GtkWidget     *widget,
+                         GdkFrameClock *frame_clock,
+                         gpointer       user_data)
+{
+  FrdpSession        *self = user_data;
+  FrdpSessionPrivate *priv = self->priv;
+
+  priv->touch_tick_id = 0;
+
+  if (priv->touch_channel != NULL)
+    frdp_channel_touch_flush (priv->touch_channel);
+
+  return G_SOURCE_REMOVE;
+}
+
+gboolean
+frdp_session_touch_event (FrdpSession          *self,
+                          GdkEventTouch        *event)
+{
+  FrdpSessionPrivate *priv = self->priv;
+  double              x = event->x, y = event->y;
+
+  if (priv->touch_channel == NULL)
+    return FALSE;
+
+  if (priv->scaling) {
+    x = (x - priv->offset_x) / priv->scale;
+    y = (y - priv->offset_y) / priv->scale;
+  }
+
+  frdp_channel_touch_update_contact (priv->touch_channel,
+                                     event->sequence,
+                                     event->type,
+                                     MAX (x, 0.0),
+                                     MAX (y, 0.0));
+
+  /* Contacts changed within one frame are sent in one touch frame. */
+  if (priv->touch_tick_id == 0)
+    priv->touch_tick_id = gtk_widget_add_tick_callback (priv->display,
+                                                        frdp_session_touch_tick,
+                                                        self,
+                                                        NULL);
 
-  freerdp_input_send_mouse_event (input, flags, 0, 0);
+  return TRUE;
 }
 
 void
@@ -1566,27 +1940,25 @@ void
 frdp_session_send_key (FrdpSession  *self,
                        GdkEventKey  *key)
 {
-  rdpInput *input = self->priv->freerdp_session->context->input;
+  FrdpSessionPrivate *priv = self->priv;
+  rdpInput           *input = priv->freerdp_session->context->input;
+  guint32             scancode;
 
-#ifdef HAVE_FREERDP_3_11_0
-  guint32   virtual_code, virtual_scan_code;
+  if (key->hardware_keycode >= G_N_ELEMENTS (priv->keycode_scancodes))
+    return;
 
-  virtual_code = GetVirtualKeyCodeFromKeycode (key->hardware_keycode, WINPR_KEYCODE_TYPE_XKB);
-  virtual_scan_code = GetVirtualScanCodeFromVirtualKeyCode (virtual_code, WINPR_KBD_TYPE_IBM_ENHANCED);
+  scancode = priv->keycode_scancodes[key->hardware_keycode];
 
-  if (virtual_scan_code != RDP_SCANCODE_UNKNOWN &&
-      (frdp_display_is_keyboard_grabbed (FRDP_DISPLAY (self->priv->display)) ||
-       (virtual_scan_code != RDP_SCANCODE_LWIN && virtual_scan_code != RDP_SCANCODE_RWIN)))
-    freerdp_input_send_keyboard_event_ex (input, key->type == GDK_KEY_PRESS, FALSE, virtual_scan_code);
+#ifdef HAVE_FREERDP_3_11_0
+  if (scancode != RDP_SCANCODE_UNKNOWN &&
+      (frdp_display_is_keyboard_grabbed (FRDP_DISPLAY (priv->display)) ||
+       (scancode != RDP_SCANCODE_LWIN && scancode != RDP_SCANCODE_RWIN)))
+    freerdp_input_send_keyboard_event_ex (input, key->type == GDK_KEY_PRESS, FALSE, scancode);
 #else
-  DWORD scancode = 0;
   guint8 keycode;
   guint16 flags;
   gboolean extended = FALSE;
 
-  scancode =
-    freerdp_keyboard_get_rdp_scancode_from_x11_keycode (key->hardware_keycode);
-
   keycode = scancode & 0xFF;
   extended = scancode & 0x100;
 
@@ -1598,6 +1970,42 @@ frdp_session_send_key (FrdpSession  *self,
 #endif
 }
 
+void
+frdp_session_send_text (FrdpSession  *self,
+                        const gchar  *text)
+{
+  FrdpSessionPrivate *priv = self->priv;
+  gunichar2          *utf16;
+  rdpInput           *input;
+  glong               length, i;
+
+  g_return_if_fail (priv->freerdp_session != NULL);
+
+  input = priv->freerdp_session->context->input;
+
+  /* Characters outside of BMP are sent as surrogate pairs. */
+  utf16 = g_utf8_to_utf16 (text, -1, NULL, &length, NULL);
+  if (utf16 == NULL)
+    return;
+
+  for (i = 0; i < length; i++) {
+    freerdp_input_send_unicode_keyboard_event (input, 0, utf16[i]);
+    freerdp_input_send_unicode_keyboard_event (input, KBD_FLAGS_RELEASE, utf16[i]);
+  }
+
+  g_free (utf16);
+}
+
+/* Whether the server accepts Unicode keyboard events (INPUT_FLAG_UNICODE) */
+gboolean
+frdp_session_supports_unicode_input (FrdpSession *self)
+{
+  FrdpSessionPrivate *priv = self->priv;
+
+  return priv->freerdp_session != NULL &&
+         freerdp_settings_get_bool (priv->freerdp_session->context->settings, FreeRDP_UnicodeInput);
+}
+
 GdkPixbuf *
 frdp_session_get_pixbuf (FrdpSession *self)
 {
@@ -86,12 +86,24 @@ void         frdp_session_mouse_smooth_scroll_event (FrdpSession          *self,
                                                      double                delta_x,
                                                      double                delta_y);
 
+void         frdp_session_mouse_relative_event (FrdpSession          *self,
+                                                double                delta_x,
+                                                double                delta_y);
+
+gboolean     frdp_session_touch_event    (FrdpSession          *self,
+                                          GdkEventTouch        *event);
+
 void         frdp_session_mouse_pointer  (FrdpSession          *self,
                                           gboolean              enter);
 
 void         frdp_session_send_key       (FrdpSession          *self,
                                           GdkEventKey          *key);
 
+void         frdp_session_send_text      (FrdpSession          *self,
+                                          const gchar          *text);
+
+gboolean     frdp_session_supports_unicode_input (FrdpSession *self);
+
 GdkPixbuf   *frdp_session_get_pixbuf     (FrdpSession          *self);
 /*FreeRDP fatal error codes*/
 typedef enum {